@@ -26,11 +26,21 @@ pub fn build(b: *std.Build) void {
     exe.addIncludePath(.{ .path = "src" });
     exe.addIncludePath(.{ .path = "canon-sdk/EDSDK/Header" });
 
-    const sources = [_][]const u8{ "src/camera.c", "src/http.c", "src/main.c", "src/mongoose.c", "src/queue.c", "src/timer.c" };
+    const sources = [_][]const u8{ "src/camera.c", "src/http.c", "src/main.c", "src/mongoose.c", "src/queue.c", "src/realtime.c", "src/settings.c", "src/timer.c" };
     const flags = [_][]const u8{"-std=gnu17"};
 
     exe.addCSourceFiles(&sources, &flags);
 
+    // web-ui files are embedded in the binary, plain and gzipped
+    const embed_assets = b.addSystemCommand(&.{ "sh", "embed-assets.sh" });
+    const assets_source = embed_assets.addOutputFileArg("assets.c");
+    const assets = [_][]const u8{ "web-ui/index.css", "web-ui/index.js", "web-ui/htmx.min.js" };
+    for (assets) |asset| {
+        embed_assets.addFileArg(.{ .path = asset });
+    }
+
+    exe.addCSourceFile(.{ .file = assets_source, .flags = &flags });
+
     if (target.isDarwin()) {
         exe.defineCMacroRaw("__MACOS__");
         exe.defineCMacroRaw("__APPLE__");
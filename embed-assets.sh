@@ -0,0 +1,69 @@
+#!/bin/sh
+
+# usage: embed-assets.sh <output.c> <files...>
+#
+# generates a C file with every file embedded as is and gzipped, served
+# from memory under /assets/<file name>
+
+set -e
+
+output=$1
+shift
+
+hex_bytes() {
+  od -An -v -tx1 | sed -e 's/ *\([0-9a-f][0-9a-f]\)/0x\1,/g'
+}
+
+mime_type() {
+  case "$1" in
+  *.js) echo "text/javascript" ;;
+  *.css) echo "text/css" ;;
+  *.html) echo "text/html" ;;
+  *.svg) echo "image/svg+xml" ;;
+  *.png) echo "image/png" ;;
+  *) echo "application/octet-stream" ;;
+  esac
+}
+
+{
+  echo "// generated by embed-assets.sh, do not edit"
+  echo ""
+  echo "#include \"assets.h\""
+  echo ""
+
+  index=0
+  for file in "$@"; do
+    echo "static const unsigned char asset_${index}[] = {"
+    hex_bytes <"$file"
+    echo "};"
+    echo ""
+    echo "static const unsigned char asset_${index}_gzip[] = {"
+    gzip -9 -n -c "$file" | hex_bytes
+    echo "};"
+    echo ""
+    index=$((index + 1))
+  done
+
+  echo "const struct asset_t g_assets[] = {"
+
+  index=0
+  for file in "$@"; do
+    # content hash, used for the etags and to version the asset urls
+    hash=$(cksum <"$file" | awk '{ printf "%08x%x", $1, $2 }')
+
+    echo "    {"
+    echo "        .path = \"/assets/$(basename "$file")\","
+    echo "        .mime_type = \"$(mime_type "$file")\","
+    echo "        .hash = \"${hash}\","
+    echo "        .data = asset_${index},"
+    echo "        .size = sizeof(asset_${index}),"
+    echo "        .gzip_data = asset_${index}_gzip,"
+    echo "        .gzip_size = sizeof(asset_${index}_gzip),"
+    echo "    },"
+    index=$((index + 1))
+  done
+
+  echo "};"
+  echo ""
+  echo "const int32_t g_assets_len = ${index};"
+} >"$output"
@@ -0,0 +1,21 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// web-ui files embedded at build time by embed-assets.sh
+struct asset_t {
+  const char *path;
+  const char *mime_type;
+  const char *hash;
+  const unsigned char *data;
+  size_t size;
+  const unsigned char *gzip_data;
+  size_t gzip_size;
+};
+
+extern const struct asset_t g_assets[];
+extern const int32_t g_assets_len;
+
+#endif // ASSETS_H
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,37 +21,127 @@ static void fill_iso_speeds(void);
 static void copy_all_exposures(void);
 static void copy_all_isos(void);
 
+#define PROPERTY_UNKNOWN 0xFFFFFFFF
+
 static struct {
+  // serializes writers only, readers go through the sequence
   pthread_mutex_t mutex;
+  // odd while a write is in progress, the state version is half of it
+  _Atomic uint64_t sequence;
   EdsCameraRef camera;
+  // last values known to be on the camera, PROPERTY_UNKNOWN when not known
+  EdsUInt32 camera_tv;
+  EdsUInt32 camera_iso;
+  // a SYNC_PROPERTIES command is queued and not yet started
+  atomic_bool properties_pending;
+  // changed while the queue was full, the next sync, connect or sequence
+  // start writes them
+  atomic_bool properties_saved;
   struct camera_state_t state;
 } g_state = {
     .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .sequence = 0,
     .camera = NULL,
+    .camera_tv = PROPERTY_UNKNOWN,
+    .camera_iso = PROPERTY_UNKNOWN,
+    .properties_pending = false,
+    .properties_saved = false,
     .state =
         {
+            .version = 0,
+            .capabilities_version = 0,
             .running = true,
             .iso_index = 0,
             .exposure_index = 0,
-            .delay_us = 1 * SEC_TO_US,
-            .exposure_us = 31 * SEC_TO_US,
-            .interval_us = 1 * SEC_TO_US,
+            .delay_ns = 1 * SEC_TO_NS,
+            .exposure_ns = 31 * SEC_TO_NS,
+            .interval_ns = 1 * SEC_TO_NS,
             .frames = 2,
             .frames_taken = 0,
+            .lateness_ns = 0,
+            .max_lateness_ns = 0,
+            .trigger_jitter = JITTER_STATS_INITIALIZER,
             .initialized = false,
             .connected = false,
             .shooting = false,
+            .busy = false,
+            .objects_created = 0,
+            .camera_changes = 0,
             .description = {0},
         },
 };
 
+#define CAMERA_EVENTS_SIZE 64
+// events handled per pump, the rest waits for the next one
+#define CAMERA_EVENTS_BATCH 16
+
+enum camera_event_kind {
+  CAMERA_EVENT_OBJECT,
+  CAMERA_EVENT_PROPERTY,
+  CAMERA_EVENT_STATE,
+};
+
+struct camera_event_t {
+  enum camera_event_kind kind;
+  EdsUInt32 event;
+  // property events only
+  EdsUInt32 property_id;
+  EdsUInt32 param;
+  // object events only, owned by the event until handled
+  EdsBaseRef object;
+};
+
+struct camera_event_cell_t {
+  _Atomic uint32_t sequence;
+  struct camera_event_t event;
+};
+
+static struct {
+  struct camera_event_cell_t cells[CAMERA_EVENTS_SIZE];
+  _Atomic uint32_t nextin;
+  // command thread only
+  uint32_t nextout;
+  _Atomic uint64_t dropped;
+} g_camera_events = {.nextin = 0, .nextout = 0, .dropped = 0};
+
+// what a drained batch found, acted upon once the batch is done
+enum camera_lost {
+  CAMERA_PRESENT,
+  CAMERA_FAILED,   // internal error, the session is closed
+  CAMERA_SHUTDOWN, // the camera is gone, so is its session
+};
+
+static enum camera_lost g_camera_lost = CAMERA_PRESENT;
+
+enum sequencer_phase {
+  SEQUENCER_IDLE,
+  SEQUENCER_WAITING,
+  SEQUENCER_EXPOSING,
+};
+
+static struct {
+  enum sequencer_phase phase;
+  struct frame_plan_t plan;
+  int32_t frame;
+  int64_t exposure_start_ns;
+  // a settings change arrived mid-sequence, written once it finishes
+  bool sync_deferred;
+} g_sequencer = {
+    .phase = SEQUENCER_IDLE,
+    .plan = {0},
+    .frame = 0,
+    .exposure_start_ns = 0,
+    .sync_deferred = false,
+};
+
 struct sync_queue_t g_main_queue = {
     .queue = QUEUE_INITIALIZER,
-    .sync_mutex = PTHREAD_MUTEX_INITIALIZER,
-    .sync_wait = PTHREAD_COND_INITIALIZER,
-    .processed = 0,
 };
 
+// bumped when a cancelling command is posted, the commands starting a
+// capture carry the value they were posted under
+static _Atomic uint32_t g_command_generation = 0;
+
 struct exposure_t {
   const char *description;
   EdsUInt32 param;
@@ -186,39 +277,143 @@ static int g_exposures_size = 0;
 static struct iso_t g_isos[ALL_ISOS_SIZE] = {0};
 static int g_isos_size = 0;
 
-void get_state_copy(struct camera_state_t *state) {
+// writers hold the mutex for a handful of stores and never across camera I/O
+static void state_write_begin(void) {
   assert(pthread_mutex_lock(&g_state.mutex) == 0);
-  memcpy(state, &g_state.state, sizeof(struct camera_state_t));
+
+  uint64_t sequence =
+      atomic_load_explicit(&g_state.sequence, memory_order_relaxed);
+  atomic_store_explicit(&g_state.sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void state_write_end(void) {
+  uint64_t sequence =
+      atomic_load_explicit(&g_state.sequence, memory_order_relaxed) + 1;
+
+  g_state.state.version = sequence >> 1;
+  atomic_store_explicit(&g_state.sequence, sequence, memory_order_release);
+
   assert(pthread_mutex_unlock(&g_state.mutex) == 0);
 }
 
+// lock free, retries only while a write is in flight
+void get_state_copy(struct camera_state_t *state) {
+  uint64_t begin, end;
+
+  do {
+    begin = atomic_load_explicit(&g_state.sequence, memory_order_acquire);
+    if (begin & 1)
+      continue;
+
+    memcpy(state, &g_state.state, sizeof(struct camera_state_t));
+
+    atomic_thread_fence(memory_order_acquire);
+    end = atomic_load_explicit(&g_state.sequence, memory_order_relaxed);
+  } while ((begin & 1) || begin != end);
+}
+
+uint64_t get_state_version(void) {
+  return atomic_load_explicit(&g_state.sequence, memory_order_acquire) >> 1;
+}
+
 bool is_running(void) {
-  assert(pthread_mutex_lock(&g_state.mutex) == 0);
-  bool ret = g_state.state.running;
-  assert(pthread_mutex_unlock(&g_state.mutex) == 0);
-  return ret;
+  struct camera_state_t state;
+  get_state_copy(&state);
+  return state.running;
+}
+
+// bounded lock-free ring filled by the sdk callbacks, which only record
+// what happened; the command thread drains it after every pump
+static bool camera_event_push(const struct camera_event_t *event) {
+  uint32_t pos =
+      atomic_load_explicit(&g_camera_events.nextin, memory_order_relaxed);
+  struct camera_event_cell_t *cell;
+
+  for (;;) {
+    cell = &g_camera_events.cells[pos % CAMERA_EVENTS_SIZE];
+    uint32_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    int32_t diff = (int32_t)(sequence - pos);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&g_camera_events.nextin, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // full, the callbacks must not block the sdk
+      atomic_fetch_add(&g_camera_events.dropped, 1);
+      return false;
+    } else {
+      pos = atomic_load_explicit(&g_camera_events.nextin, memory_order_relaxed);
+    }
+  }
+
+  cell->event = *event;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+  return true;
+}
+
+static bool camera_event_pop(struct camera_event_t *event) {
+  uint32_t pos = g_camera_events.nextout;
+  struct camera_event_cell_t *cell =
+      &g_camera_events.cells[pos % CAMERA_EVENTS_SIZE];
+  uint32_t sequence =
+      atomic_load_explicit(&cell->sequence, memory_order_acquire);
+
+  if ((int32_t)(sequence - (pos + 1)) < 0)
+    return false;
+
+  *event = cell->event;
+  atomic_store_explicit(&cell->sequence, pos + CAMERA_EVENTS_SIZE,
+                        memory_order_release);
+  g_camera_events.nextout = pos + 1;
+
+  return true;
 }
 
-#ifdef CAMERA_EVENTS
 static EdsError EDSCALLBACK handle_object_event(EdsObjectEvent event,
                                                 EdsBaseRef object_ref,
                                                 EdsVoid *data) {
-  MG_DEBUG(("Event = %u", event));
-  return EdsRelease(object_ref);
+  struct camera_event_t camera_event = {
+      .kind = CAMERA_EVENT_OBJECT,
+      .event = event,
+      .object = object_ref,
+  };
+
+  // the object is released once handled
+  if (!camera_event_push(&camera_event) && object_ref != NULL)
+    EdsRelease(object_ref);
+
+  return EDS_ERR_OK;
 }
 
 static EdsError EDSCALLBACK handle_property_event(EdsPropertyEvent event,
                                                   EdsUInt32 property_id,
                                                   EdsUInt32 param,
                                                   EdsVoid *data) {
-  MG_DEBUG(
-      ("Event = %u, Property = %u, Param = %u", event, property_id, param));
+  struct camera_event_t camera_event = {
+      .kind = CAMERA_EVENT_PROPERTY,
+      .event = event,
+      .property_id = property_id,
+      .param = param,
+  };
+  camera_event_push(&camera_event);
+
   return EDS_ERR_OK;
 }
 
 static EdsError EDSCALLBACK handle_state_event(EdsStateEvent event,
                                                EdsUInt32 param, EdsVoid *data) {
-  MG_DEBUG(("Event = %u, Param = %u", event, param));
+  struct camera_event_t camera_event = {
+      .kind = CAMERA_EVENT_STATE,
+      .event = event,
+      .param = param,
+  };
+  camera_event_push(&camera_event);
+
   return EDS_ERR_OK;
 }
 
@@ -230,9 +425,6 @@ static void attach_camera_callbacks(void) {
   EdsSetCameraStateEventHandler(g_state.camera, kEdsStateEvent_All,
                                 handle_state_event, NULL);
 }
-#else
-static void attach_camera_callbacks(void) {}
-#endif
 
 static bool detect_connected_camera(void) {
   EdsCameraListRef camera_list = NULL;
@@ -260,8 +452,10 @@ static bool detect_connected_camera(void) {
         if (camera_ref != NULL &&
             EdsGetDeviceInfo(camera_ref, &device_info) == EDS_ERR_OK) {
           g_state.camera = camera_ref;
+          state_write_begin();
           strncpy(g_state.state.description, device_info.szDeviceDescription,
                   EDS_MAX_NAME);
+          state_write_end();
         } else {
           EdsRelease(camera_ref);
           EdsRelease(camera_list);
@@ -283,72 +477,169 @@ static bool detect_connected_camera(void) {
   return true;
 }
 
-static bool press_shutter(int64_t *ts) {
-  int64_t start = get_system_micros();
+#define LATENCY_MODELS 4
+
+// press and release latencies differ between bodies, each connected model
+// keeps its own estimates for as long as the process runs
+struct latency_model_t {
+  char model[EDS_MAX_NAME];
+  int64_t last_used_ns;
+  struct latency_estimator_t press;
+  struct latency_estimator_t release;
+};
+
+static struct latency_model_t g_latency_models[LATENCY_MODELS];
+static struct latency_model_t *g_latency = &g_latency_models[0];
+
+// time a frame spends in shutter commands, the exposure excluded; read by
+// the http thread to validate intervals
+static _Atomic int64_t g_trigger_latency_ns = 0;
+
+static void update_trigger_latency(void) {
+  atomic_store(&g_trigger_latency_ns,
+               latency_estimator_get(&g_latency->press) +
+                   latency_estimator_get(&g_latency->release));
+}
+
+// reuses the estimates of a model seen before, otherwise takes over the
+// least recently used slot
+static void select_latency_model(const char *model) {
+  struct latency_model_t *selected = &g_latency_models[0];
+
+  for (int32_t i = 0; i < LATENCY_MODELS; i++) {
+    struct latency_model_t *candidate = &g_latency_models[i];
+
+    if (strncmp(candidate->model, model, EDS_MAX_NAME) == 0) {
+      selected = candidate;
+      break;
+    }
+
+    if (candidate->last_used_ns < selected->last_used_ns)
+      selected = candidate;
+  }
+
+  if (strncmp(selected->model, model, EDS_MAX_NAME) != 0) {
+    strncpy(selected->model, model, EDS_MAX_NAME - 1);
+    selected->model[EDS_MAX_NAME - 1] = '\0';
+    selected->press =
+        (struct latency_estimator_t)LATENCY_ESTIMATOR_INITIALIZER;
+    selected->release =
+        (struct latency_estimator_t)LATENCY_ESTIMATOR_INITIALIZER;
+  }
+
+  selected->last_used_ns = get_monotonic_ns();
+  g_latency = selected;
+  update_trigger_latency();
+}
+
+int64_t get_trigger_latency_ns(void) {
+  return atomic_load(&g_trigger_latency_ns);
+}
+
+static EdsError press_shutter(int64_t *ts) {
+  int64_t start = get_monotonic_ns();
   EdsError err =
       EdsSendCommand(g_state.camera, kEdsCameraCommand_PressShutterButton,
                      kEdsCameraCommand_ShutterButton_Completely_NonAF);
-  int64_t delta = get_system_micros() - start;
+  int64_t delta = get_monotonic_ns() - start;
 
   if (err != EDS_ERR_OK) {
     MG_DEBUG(("Press Shutter err = %d", err));
-    return false;
+    return err;
   }
 
-  MG_DEBUG(("Press Button: %lld ms", delta / 1000));
+  MG_DEBUG(("Press Button: %lld ms", (long long)(delta / MILLI_TO_NS)));
+  if (!latency_estimator_add(&g_latency->press, delta))
+    MG_INFO(("Press latency outlier: %lld us",
+             (long long)(delta / MICRO_TO_NS)));
+  update_trigger_latency();
 
+  // the shutter is open once the command returns
   if (ts != NULL)
-    *ts = start;
+    *ts = start + delta;
 
-  return true;
+  return EDS_ERR_OK;
 }
 
-static bool release_shutter(int64_t *ts) {
-  int64_t start = get_system_micros();
+static EdsError release_shutter(int64_t *ts) {
+  int64_t start = get_monotonic_ns();
   EdsError err =
       EdsSendCommand(g_state.camera, kEdsCameraCommand_PressShutterButton,
                      kEdsCameraCommand_ShutterButton_OFF);
-  int64_t end = get_system_micros();
+  int64_t end = get_monotonic_ns();
 
   if (err != EDS_ERR_OK) {
     MG_DEBUG(("Release Shutter err = %d", err));
-    return false;
+    return err;
   }
 
   int64_t delta = end - start;
-  MG_DEBUG(("Release Button: %lld ms", delta / 1000));
+  MG_DEBUG(("Release Button: %lld ms", (long long)(delta / MILLI_TO_NS)));
+  if (!latency_estimator_add(&g_latency->release, delta))
+    MG_INFO(("Release latency outlier: %lld us",
+             (long long)(delta / MICRO_TO_NS)));
+  update_trigger_latency();
 
   if (ts != NULL)
     *ts = end;
 
-  return true;
+  return EDS_ERR_OK;
 }
 
-static void no_op_command(void *data) {}
+static const char *command_names[] = {
+    "NO_OP",          "INITIALIZE",      "DEINITIALIZE",
+    "CONNECT",        "DISCONNECT",      "TAKE_PICTURE",
+    "SEQUENCER_STEP", "SYNC_PROPERTIES", "START_SHOOTING",
+    "STOP_SHOOTING",  "TERMINATE",       "EVENT_PUMP",
+};
+
+static struct timer_heap_t g_timers = TIMER_HEAP_INITIALIZER;
+static int64_t g_timer_guard_ns = TIMER_GUARD_NS;
+static enum wait_mode g_timer_mode = WAIT_YIELD;
+
+static EdsError no_op_command(void *data) { return EDS_ERR_OK; }
+
+static void discard_camera_events(void);
+static bool sequencer_busy(void);
+static void sequencer_stop(void);
+
+static EdsError deinitialize_command(void *data) {
+  EdsError err = EDS_ERR_OK;
+
+  // queued objects are released while the sdk is still there
+  discard_camera_events();
 
-static void deinitialize_command(void *data) {
   if (g_state.camera != NULL) {
     EdsRelease(g_state.camera);
     g_state.camera = NULL;
   }
 
   if (g_state.state.initialized) {
-    EdsTerminateSDK();
+    err = EdsTerminateSDK();
   }
+  state_write_begin();
   g_state.state.initialized = false;
   g_state.state.connected = false;
+  state_write_end();
+  g_state.camera_tv = PROPERTY_UNKNOWN;
+  g_state.camera_iso = PROPERTY_UNKNOWN;
+
+  return err;
 }
 
-static void initialize_command(void *data) {
+static EdsError initialize_command(void *data) {
   if (!g_state.state.initialized) {
     MG_DEBUG(("Initializing"));
 
-    if (EdsInitializeSDK() != EDS_ERR_OK) {
+    EdsError err = EdsInitializeSDK();
+    if (err != EDS_ERR_OK) {
       MG_DEBUG(("Error initializing SDK"));
-      return;
+      return err;
     }
 
+    state_write_begin();
     g_state.state.initialized = true;
+    state_write_end();
   } else {
     MG_DEBUG(("Already initialized"));
   }
@@ -358,57 +649,142 @@ static void initialize_command(void *data) {
   if (!detect_connected_camera()) {
     MG_DEBUG(("Error detecting camera"));
     deinitialize_command(NULL);
+    return EDS_ERR_DEVICE_NOT_FOUND;
   }
 
   attach_camera_callbacks();
+
+  return EDS_ERR_OK;
 }
 
-static void set_shutter_speed(EdsUInt32 shutter_speed) {
+static EdsError set_shutter_speed(EdsUInt32 shutter_speed) {
+  if (g_state.camera_tv == shutter_speed)
+    return EDS_ERR_OK;
+
   EdsError err = EdsSetPropertyData(g_state.camera, kEdsPropID_Tv, 0,
                                     sizeof(EdsUInt32), &shutter_speed);
 
   if (err != EDS_ERR_OK) {
     MG_DEBUG(("Error setting shutter speed"));
+    g_state.camera_tv = PROPERTY_UNKNOWN;
+  } else {
+    g_state.camera_tv = shutter_speed;
   }
+
+  return err;
 }
 
-static void set_iso_speed(EdsUInt32 iso_speed) {
+static EdsError set_iso_speed(EdsUInt32 iso_speed) {
+  if (g_state.camera_iso == iso_speed)
+    return EDS_ERR_OK;
+
   EdsError err = EdsSetPropertyData(g_state.camera, kEdsPropID_ISOSpeed, 0,
                                     sizeof(EdsUInt32), &iso_speed);
 
   if (err != EDS_ERR_OK) {
     MG_DEBUG(("Error setting iso speed"));
+    g_state.camera_iso = PROPERTY_UNKNOWN;
+  } else {
+    g_state.camera_iso = iso_speed;
   }
+
+  return err;
+}
+
+static EdsUInt32 get_property(EdsPropertyID property_id) {
+  EdsUInt32 value = PROPERTY_UNKNOWN;
+
+  if (EdsGetPropertyData(g_state.camera, property_id, 0, sizeof(EdsUInt32),
+                         &value) != EDS_ERR_OK)
+    return PROPERTY_UNKNOWN;
+
+  return value;
 }
 
-static void update_shutter_speed(void) {
+static EdsError update_shutter_speed(void) {
   if (!g_state.state.initialized || !g_state.state.connected) {
-    return;
+    return EDS_ERR_OK;
   }
 
-  if (g_state.state.exposure_index < g_exposures_size) {
-    struct exposure_t exposure = g_exposures[g_state.state.exposure_index];
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  if (state.exposure_index < g_exposures_size) {
+    struct exposure_t exposure = g_exposures[state.exposure_index];
     MG_DEBUG(("Setting shutter speed = %s", exposure.description));
-    set_shutter_speed(exposure.param);
-  } else {
-    MG_DEBUG(("Setting camera to Bulb mode"));
-    set_shutter_speed(0x0C);
+    return set_shutter_speed(exposure.param);
   }
+
+  MG_DEBUG(("Setting camera to Bulb mode"));
+  return set_shutter_speed(0x0C);
 }
 
-static void update_iso_speed(void) {
+static EdsError update_iso_speed(void) {
   if (!g_state.state.initialized || !g_state.state.connected) {
-    return;
+    return EDS_ERR_OK;
   }
 
-  if (g_state.state.iso_index < g_isos_size) {
-    struct iso_t iso = g_isos[g_state.state.iso_index];
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  if (state.iso_index < g_isos_size) {
+    struct iso_t iso = g_isos[state.iso_index];
     MG_DEBUG(("Setting to ISO = %s", iso.description));
-    set_iso_speed(iso.param);
-  } else {
-    MG_DEBUG(("Setting camera to ISO auto"));
-    set_iso_speed(0x0);
+    return set_iso_speed(iso.param);
+  }
+
+  MG_DEBUG(("Setting camera to ISO auto"));
+  return set_iso_speed(0x0);
+}
+
+// bursts of setter calls collapse into one queued SYNC_PROPERTIES, which
+// writes whatever the latest values are when it runs; called from the http
+// thread, so it never waits for room in the queue. The flag is raised before
+// the indices change, a property event in between would put the camera's old
+// values back; *notice is set when the value was applied but the queue was
+// full
+static const char *request_property_sync(
+    const struct camera_settings_t *settings, const char **notice) {
+  *notice = NULL;
+
+  bool was_pending = atomic_exchange(&g_state.properties_pending, true);
+
+  const char *error = apply_settings(settings);
+
+  // the queued sync writes it, unless it started meanwhile and may have
+  // read the old values
+  if (was_pending && atomic_exchange(&g_state.properties_pending, true))
+    return error;
+
+  if (error == NULL &&
+      !async_queue_try_post(&g_main_queue, SYNC_PROPERTIES, NULL)) {
+    atomic_store(&g_state.properties_saved, true);
+    *notice = SETTINGS_SAVED_NOTICE;
+  }
+
+  if (error != NULL || *notice != NULL)
+    atomic_store(&g_state.properties_pending, false);
+
+  return error;
+}
+
+// all the property writes of a settings change run in one command, the
+// first error is reported; a running sequence keeps its exposure, the
+// writes wait for sequencer_finish() and the setters keep coalescing
+static EdsError sync_properties_command(void *data) {
+  if (sequencer_busy()) {
+    MG_DEBUG(("Sequence running, settings written when it finishes"));
+    g_sequencer.sync_deferred = true;
+    return EDS_ERR_OK;
   }
+
+  atomic_store(&g_state.properties_pending, false);
+  atomic_store(&g_state.properties_saved, false);
+
+  EdsError err = update_shutter_speed();
+  EdsError iso_err = update_iso_speed();
+
+  return err != EDS_ERR_OK ? err : iso_err;
 }
 
 static void lock_ui(void) {
@@ -429,20 +805,44 @@ static void unlock_ui(void) {
   }
 }
 
-static void connect_command(void *data) {
+// a capture queued before a STOP_SHOOTING or DISCONNECT posted since
+static bool command_cancelled(void *data) {
+  uint32_t generation = (uint32_t)(uintptr_t)data;
+  if (generation == atomic_load(&g_command_generation))
+    return false;
+
+  MG_DEBUG(("Cancelled by a later stop or disconnect"));
+  return true;
+}
+
+static EdsError connect_command(void *data) {
   if (g_state.state.connected) {
     MG_DEBUG(("Already connected"));
-    return;
+    return EDS_ERR_OK;
   }
 
   MG_DEBUG(("Connecting to %s", g_state.state.description));
 
-  if (EdsOpenSession(g_state.camera) == EDS_ERR_OK) {
+  EdsError err = EdsOpenSession(g_state.camera);
+  if (err == EDS_ERR_OK) {
     MG_DEBUG(("Session opened"));
-    g_state.state.connected = true;
+    g_state.camera_tv = get_property(kEdsPropID_Tv);
+    g_state.camera_iso = get_property(kEdsPropID_ISOSpeed);
     fill_exposures();
     fill_iso_speeds();
+
+    select_latency_model(g_state.state.description);
+
+    // the lists are complete before anyone sees the camera connected
+    state_write_begin();
+    g_state.state.connected = true;
+    g_state.state.capabilities_version++;
+    g_state.state.busy = false;
+    g_state.state.objects_created = 0;
+    state_write_end();
+
     lock_ui();
+    atomic_store(&g_state.properties_saved, false);
     update_shutter_speed();
     update_iso_speed();
   } else {
@@ -450,121 +850,580 @@ static void connect_command(void *data) {
     // something bad happened, deinitialize and start again
     deinitialize_command(NULL);
   }
+
+  return err;
 }
 
-static void disconnect_command(void *data) {
+static EdsError disconnect_command(void *data) {
   if (!g_state.state.connected) {
     MG_DEBUG(("Already disconnected"));
-    return;
+    return EDS_ERR_OK;
   }
 
+  // runs on the control lane, possibly mid-exposure: the shutter is
+  // released while the session is still open
+  if (sequencer_busy())
+    sequencer_stop();
+
   unlock_ui();
 
   MG_DEBUG(("Disconnecting from %s", g_state.state.description));
 
-  if (EdsCloseSession(g_state.camera) != EDS_ERR_OK) {
+  EdsError err = EdsCloseSession(g_state.camera);
+  if (err != EDS_ERR_OK) {
     // something bad happened, deinitialize and start again
     deinitialize_command(NULL);
   }
 
+  state_write_begin();
   g_state.state.connected = false;
+  state_write_end();
+  g_state.camera_tv = PROPERTY_UNKNOWN;
+  g_state.camera_iso = PROPERTY_UNKNOWN;
+
+  return err;
 }
 
-static void initial_delay_command(void *data) {
-  if (g_state.state.delay_us > 0) {
-    if (!ussleep(g_state.state.delay_us)) {
-      g_state.state.shooting = false;
-      return;
-    }
+static void schedule_command(int64_t deadline_ns, int32_t cmd) {
+  if (!timer_heap_push(&g_timers, deadline_ns, cmd, NULL)) {
+    MG_ERROR(("Timer heap full, dropping %s", command_names[cmd]));
   }
+}
 
-  async_queue_post(&g_main_queue, TAKE_PICTURE, NULL, /*async*/ true);
+static bool is_bulb(const struct camera_state_t *state) {
+  return state->exposure_index >= g_exposures_size;
 }
 
-static void interval_delay_command(void *data) {
-  if (ussleep(g_state.state.interval_us)) {
-    async_queue_post(&g_main_queue, TAKE_PICTURE, NULL, /*async*/ true);
-  } else {
-    MG_DEBUG(("Stop shooting"));
-    g_state.state.shooting = false;
+static void sequencer_plan(struct frame_plan_t *plan, int32_t frames,
+                           int64_t delay_ns) {
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  frame_plan_init(plan, add_ns(get_monotonic_ns(), delay_ns), frames,
+                  state.interval_ns, state.exposure_ns, is_bulb(&state));
+}
+
+static int64_t frame_deadline_ns(int32_t frame) {
+  return frame_plan_deadline_ns(&g_sequencer.plan, frame);
+}
+
+static void record_lateness(int32_t frame) {
+  int64_t lateness_ns = get_monotonic_ns() - frame_deadline_ns(frame);
+
+  // single pictures don't count towards the sequence stats
+  if (!g_state.state.shooting)
+    return;
+
+  state_write_begin();
+  g_state.state.lateness_ns = lateness_ns;
+  if (frame == 0 || lateness_ns > g_state.state.max_lateness_ns)
+    g_state.state.max_lateness_ns = lateness_ns;
+  jitter_stats_add(&g_state.state.trigger_jitter, lateness_ns);
+  state_write_end();
+
+  MG_INFO(("Frame %d: lateness %lld us (max %lld us)", frame,
+           (long long)(lateness_ns / MICRO_TO_NS),
+           (long long)(g_state.state.max_lateness_ns / MICRO_TO_NS)));
+}
+
+static bool sequencer_busy(void) {
+  return g_sequencer.phase != SEQUENCER_IDLE;
+}
+
+static void sequencer_start(int32_t frames, int64_t delay_ns) {
+  sequencer_plan(&g_sequencer.plan, frames, delay_ns);
+  g_sequencer.frame = 0;
+
+  if (g_state.state.shooting) {
+    state_write_begin();
+    g_state.state.frames_taken = 0;
+    g_state.state.lateness_ns = 0;
+    g_state.state.max_lateness_ns = 0;
+    g_state.state.trigger_jitter =
+        (struct jitter_stats_t)JITTER_STATS_INITIALIZER;
+    state_write_end();
   }
+
+  g_sequencer.phase = SEQUENCER_WAITING;
 }
 
-static void take_picture_command(void *data) {
-  if (!g_state.state.initialized || !g_state.state.connected)
+static void report_trigger_jitter(void) {
+  const struct jitter_stats_t *stats = &g_state.state.trigger_jitter;
+  if (stats->count == 0)
+    return;
+
+  MG_INFO(("Trigger jitter over %d frames: min %lld us, mean %lld us, "
+           "max %lld us, stddev %lld us",
+           stats->count, (long long)(stats->min_ns / MICRO_TO_NS),
+           (long long)(stats->mean_ns / MICRO_TO_NS),
+           (long long)(stats->max_ns / MICRO_TO_NS),
+           (long long)(jitter_stats_stddev_ns(stats) / MICRO_TO_NS)));
+}
+
+static void sequencer_finish(void) {
+  MG_DEBUG(("Stop shooting"));
+  if (g_state.state.shooting)
+    report_trigger_jitter();
+  timer_heap_remove(&g_timers, SEQUENCER_STEP);
+  g_sequencer.phase = SEQUENCER_IDLE;
+
+  state_write_begin();
+  g_state.state.shooting = false;
+  state_write_end();
+
+  if (g_sequencer.sync_deferred) {
+    g_sequencer.sync_deferred = false;
+    sync_properties_command(NULL);
+  }
+}
+
+static void sequencer_next_frame(void) {
+  int32_t frame = ++g_sequencer.frame;
+
+  if (g_state.state.shooting) {
+    state_write_begin();
+    g_state.state.frames_taken = frame;
+    state_write_end();
+  }
+
+  if (frame >= g_sequencer.plan.frames) {
+    sequencer_finish();
     return;
+  }
 
-  if (g_state.state.exposure_index < g_exposures_size) {
+  g_sequencer.phase = SEQUENCER_WAITING;
+  schedule_command(frame_deadline_ns(frame), SEQUENCER_STEP);
+}
+
+static EdsError sequencer_capture(void) {
+  record_lateness(g_sequencer.frame);
+
+  if (!g_sequencer.plan.bulb) {
     // using native time
-    press_shutter(NULL);
-    release_shutter(NULL);
-  } else {
-    int64_t delay_average_us = get_delay_average();
+    EdsError err = press_shutter(NULL);
+    EdsError release_err = release_shutter(NULL);
+    sequencer_next_frame();
 
-    int64_t start_us, end_us;
+    return err != EDS_ERR_OK ? err : release_err;
+  }
 
-    bool success = press_shutter(&start_us);
+  EdsError err = press_shutter(&g_sequencer.exposure_start_ns);
+  if (err != EDS_ERR_OK) {
+    sequencer_next_frame();
+    return err;
+  }
 
-    if (success) {
-      g_state.state.shooting =
-          ussleep(g_state.state.exposure_us - delay_average_us);
-    }
+  int64_t release_ns =
+      frame_plan_release_ns(&g_sequencer.plan, g_sequencer.exposure_start_ns,
+                            latency_estimator_get(&g_latency->release));
+
+  // the loop stays free until the release deadline
+  g_sequencer.phase = SEQUENCER_EXPOSING;
+  schedule_command(release_ns, SEQUENCER_STEP);
+
+  return EDS_ERR_OK;
+}
 
-    success = release_shutter(&end_us);
+static EdsError sequencer_release(void) {
+  int64_t end_ns;
 
-    if (success)
-      add_delay((end_us - start_us) - g_state.state.exposure_us);
+  EdsError err = release_shutter(&end_ns);
+  if (err == EDS_ERR_OK) {
+    int64_t error_ns = (end_ns - g_sequencer.exposure_start_ns) -
+                       g_sequencer.plan.exposure_ns;
+    MG_INFO(("Exposure error: %lld us", (long long)(error_ns / MICRO_TO_NS)));
   }
 
-  if (g_state.state.shooting &&
-      ++g_state.state.frames_taken < g_state.state.frames) {
-    async_queue_post(&g_main_queue, INTERVAL_DELAY, NULL, /*async*/ true);
-  } else {
-    MG_DEBUG(("Stop shooting"));
-    g_state.state.shooting = false;
+  sequencer_next_frame();
+
+  return err;
+}
+
+static void sequencer_stop(void) {
+  if (g_sequencer.phase == SEQUENCER_EXPOSING) {
+    // close an in-flight bulb exposure now instead of at its deadline
+    release_shutter(NULL);
   }
+
+  sequencer_finish();
 }
 
-static void take_single_picture_command(void *data) {
-  intptr_t frames = g_state.state.frames;
-  g_state.state.frames = 1;
-  async_queue_post(&g_main_queue, TAKE_PICTURE, NULL, /*async*/ true);
-  async_queue_post(&g_main_queue, SET_FRAMES, (void *)frames, /*async*/ true);
+static EdsError sequencer_step_command(void *data) {
+  if (!g_state.state.initialized || !g_state.state.connected) {
+    sequencer_finish();
+    return EDS_ERR_SESSION_NOT_OPEN;
+  }
+
+  switch (g_sequencer.phase) {
+  case SEQUENCER_WAITING:
+    return sequencer_capture();
+  case SEQUENCER_EXPOSING:
+    return sequencer_release();
+  case SEQUENCER_IDLE:
+    break;
+  }
+
+  return EDS_ERR_OK;
 }
 
-static void set_frames_command(void *data) {
-  int32_t frames = (intptr_t)data;
-  g_state.state.frames = frames;
+static EdsError take_picture_command(void *data) {
+  if (command_cancelled(data))
+    return EDS_ERR_OPERATION_CANCELLED;
+
+  if (!g_state.state.initialized || !g_state.state.connected)
+    return EDS_ERR_SESSION_NOT_OPEN;
+
+  if (sequencer_busy()) {
+    MG_DEBUG(("Sequence in progress"));
+    return EDS_ERR_DEVICE_BUSY;
+  }
+
+  // a single frame through the sequencer, without touching the settings
+  sequencer_start(1, 0);
+  return sequencer_step_command(NULL);
 }
 
-static void start_shooting_command(void *data) {
-  g_state.state.frames_taken = 0;
-  g_state.state.shooting = true;
+static EdsError start_shooting_command(void *data) {
+  if (command_cancelled(data))
+    return EDS_ERR_OPERATION_CANCELLED;
+
+  if (!g_state.state.initialized || !g_state.state.connected)
+    return EDS_ERR_SESSION_NOT_OPEN;
+
+  if (sequencer_busy()) {
+    MG_DEBUG(("Sequence in progress"));
+    return EDS_ERR_DEVICE_BUSY;
+  }
 
+  atomic_store(&g_state.properties_saved, false);
   update_shutter_speed();
   update_iso_speed();
 
-  async_queue_post(&g_main_queue, INITIAL_DELAY, NULL, /*async*/ true);
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  state_write_begin();
+  g_state.state.shooting = true;
+  state_write_end();
+
+  sequencer_start(state.frames, state.delay_ns);
+  schedule_command(g_sequencer.plan.start_ns, SEQUENCER_STEP);
+
+  return EDS_ERR_OK;
 }
 
-static void stop_shooting_command(void *data) {
-  g_state.state.shooting = false;
+static EdsError stop_shooting_command(void *data) {
+  if (sequencer_busy())
+    sequencer_stop();
+
+  return EDS_ERR_OK;
 }
 
-static void terminate_command(void *data) {
+static EdsError terminate_command(void *data) {
   MG_DEBUG(("Terminating"));
+  stop_shooting_command(NULL);
+  state_write_begin();
   g_state.state.running = false;
+  state_write_end();
+
+  return EDS_ERR_OK;
 }
 
-static const char *command_names[] = {
-    "NO_OP",          "INITIALIZE",     "DEINITIALIZE",
-    "CONNECT",        "DISCONNECT",     "INITIAL_DELAY",
-    "INTERVAL_DELAY", "TAKE_PICTURE",   "TAKE_SINGLE_PICTURE",
-    "SET_FRAMES",     "START_SHOOTING", "STOP_SHOOTING",
-    "TERMINATE",
+typedef EdsError (*command_handler_t)(void *);
+
+static int32_t exposure_index_of(EdsUInt32 tv) {
+  if (tv == 0x0C)
+    return g_exposures_size; // bulb
+
+  for (int32_t i = 0; i < g_exposures_size; i++) {
+    if (g_exposures[i].param == tv)
+      return i;
+  }
+
+  return -1;
+}
+
+static int32_t iso_index_of(EdsUInt32 iso) {
+  for (int32_t i = 0; i < g_isos_size; i++) {
+    if (g_isos[i].param == iso)
+      return i;
+  }
+
+  return -1;
+}
+
+// a dial turned on the camera shows up in the settings, unless a change
+// made here is still waiting to be written or a sequence owns the camera
+static void handle_property_changed(EdsUInt32 property_id) {
+  if (property_id == kEdsPropID_Tv)
+    g_state.camera_tv = get_property(kEdsPropID_Tv);
+  else if (property_id == kEdsPropID_ISOSpeed)
+    g_state.camera_iso = get_property(kEdsPropID_ISOSpeed);
+  else
+    return;
+
+  if (atomic_load(&g_state.properties_pending) ||
+      atomic_load(&g_state.properties_saved) || sequencer_busy())
+    return;
+
+  int32_t exposure_index = exposure_index_of(g_state.camera_tv);
+  int32_t iso_index = iso_index_of(g_state.camera_iso);
+
+  bool exposure_changed =
+      exposure_index >= 0 && exposure_index != g_state.state.exposure_index;
+  bool iso_changed = iso_index >= 0 && iso_index != g_state.state.iso_index;
+
+  // the echo of a write made from here changes nothing
+  if (!exposure_changed && !iso_changed)
+    return;
+
+  state_write_begin();
+  if (exposure_changed)
+    g_state.state.exposure_index = exposure_index;
+  if (iso_changed)
+    g_state.state.iso_index = iso_index;
+  g_state.state.camera_changes++;
+  state_write_end();
+}
+
+static void handle_object(const struct camera_event_t *event) {
+  switch (event->event) {
+  case kEdsObjectEvent_DirItemCreated:
+    state_write_begin();
+    g_state.state.objects_created++;
+    state_write_end();
+    break;
+
+  case kEdsObjectEvent_DirItemRequestTransfer:
+    // nothing downloads here, the camera would keep the image buffered
+    EdsDownloadCancel(event->object);
+    break;
+  }
+
+  if (event->object != NULL)
+    EdsRelease(event->object);
+}
+
+// after a shutdown the camera can't be talked to, no ui unlock and no
+// session close; the sdk is reset so the next initialize finds it again
+static void handle_camera_lost(enum camera_lost lost) {
+  // nothing left to write the deferred settings to
+  if (g_sequencer.sync_deferred) {
+    g_sequencer.sync_deferred = false;
+    atomic_store(&g_state.properties_pending, false);
+  }
+
+  // a failed camera may still take the release of an open bulb exposure,
+  // a shut down one can't be reached
+  if (sequencer_busy()) {
+    if (lost == CAMERA_FAILED && g_state.state.connected)
+      sequencer_stop();
+    else
+      sequencer_finish();
+  }
+
+  if (!g_state.state.connected)
+    return;
+
+  if (lost == CAMERA_SHUTDOWN)
+    deinitialize_command(NULL);
+  else
+    disconnect_command(NULL);
+}
+
+static void handle_state(const struct camera_event_t *event) {
+  switch (event->event) {
+  case kEdsStateEvent_Shutdown:
+    MG_INFO(("Camera shut down"));
+    g_camera_lost = CAMERA_SHUTDOWN;
+    break;
+
+  case kEdsStateEvent_InternalError:
+    MG_ERROR(("Camera internal error %u", event->param));
+    if (g_camera_lost != CAMERA_SHUTDOWN)
+      g_camera_lost = CAMERA_FAILED;
+    break;
+
+  case kEdsStateEvent_JobStatusChanged:
+    state_write_begin();
+    g_state.state.busy = event->param != 0;
+    state_write_end();
+    break;
+
+  case kEdsStateEvent_WillSoonShutDown:
+    if (g_state.state.connected)
+      EdsSendCommand(g_state.camera, kEdsCameraCommand_ExtendShutDownTimer, 0);
+    break;
+
+  case kEdsStateEvent_CaptureError:
+    MG_ERROR(("Capture failed on frame %d", g_sequencer.frame));
+    break;
+  }
+}
+
+static void handle_camera_event(const struct camera_event_t *event) {
+  // whatever follows a shutdown in the batch is about a camera that's gone
+  if (g_camera_lost == CAMERA_SHUTDOWN) {
+    if (event->kind == CAMERA_EVENT_OBJECT && event->object != NULL)
+      EdsRelease(event->object);
+    return;
+  }
+
+  switch (event->kind) {
+  case CAMERA_EVENT_OBJECT:
+    handle_object(event);
+    break;
+
+  case CAMERA_EVENT_PROPERTY:
+    if (event->event == kEdsPropertyEvent_PropertyChanged &&
+        g_state.state.connected)
+      handle_property_changed(event->property_id);
+    break;
+
+  case CAMERA_EVENT_STATE:
+    handle_state(event);
+    break;
+  }
+}
+
+static void drain_camera_events(int32_t max_events) {
+  struct camera_event_t event;
+
+  for (int32_t i = 0; i < max_events && camera_event_pop(&event); i++)
+    handle_camera_event(&event);
+
+  enum camera_lost lost = g_camera_lost;
+  g_camera_lost = CAMERA_PRESENT;
+
+  if (lost != CAMERA_PRESENT)
+    handle_camera_lost(lost);
+}
+
+// drops what is queued without acting on it, objects are still released
+static void discard_camera_events(void) {
+  struct camera_event_t event;
+
+  while (camera_event_pop(&event)) {
+    if (event.kind == CAMERA_EVENT_OBJECT && event.object != NULL)
+      EdsRelease(event.object);
+  }
+}
+
+// pumps run in slots every period_ns, a late pump doesn't shift the
+// following slots
+static struct {
+  int64_t period_ns;
+  int64_t slot_ns;
+  // pushed behind a step once, the pump runs next whatever follows: short
+  // intervals would defer it on every frame
+  bool postponed;
+  // written by the command thread, read by the http thread
+  _Atomic uint64_t pumps;
+  _Atomic uint64_t deferred;
+  _Atomic int64_t total_lateness_ns;
+  _Atomic int64_t max_lateness_ns;
+  _Atomic int64_t total_duration_ns;
+  _Atomic int64_t max_duration_ns;
+} g_event_pump = {
+    .period_ns = EVENT_PUMP_NS,
+    .slot_ns = 0,
+    .postponed = false,
 };
 
-typedef void (*command_handler_t)(void *);
+void set_event_pump_period(int64_t period_ns) {
+  g_event_pump.period_ns = period_ns;
+}
+
+void get_event_pump_stats(struct event_pump_stats_t *stats) {
+  stats->period_ns = g_event_pump.period_ns;
+  stats->pumps = atomic_load(&g_event_pump.pumps);
+  stats->deferred = atomic_load(&g_event_pump.deferred);
+  stats->total_lateness_ns = atomic_load(&g_event_pump.total_lateness_ns);
+  stats->max_lateness_ns = atomic_load(&g_event_pump.max_lateness_ns);
+  stats->total_duration_ns = atomic_load(&g_event_pump.total_duration_ns);
+  stats->max_duration_ns = atomic_load(&g_event_pump.max_duration_ns);
+  stats->events_dropped = atomic_load(&g_camera_events.dropped);
+}
+
+// a pump never runs in the way of a shutter command: one already due, or
+// due within twice the guard band, so a late wake-up still leaves the guard
+// band free, plus what a pump usually takes
+static bool pump_blocks_step(int64_t pump_ns, int64_t *step_ns) {
+  if (!timer_heap_find(&g_timers, SEQUENCER_STEP, step_ns))
+    return false;
+
+  uint64_t pumps = atomic_load(&g_event_pump.pumps);
+  int64_t average_ns =
+      pumps > 0 ? atomic_load(&g_event_pump.total_duration_ns) / (int64_t)pumps
+                : 0;
+
+  return *step_ns - pump_ns <= 2 * g_timer_guard_ns + 2 * average_ns;
+}
+
+// right after the step, which pops first with an earlier deadline
+static void defer_event_pump(int64_t step_ns) {
+  g_event_pump.postponed = true;
+  schedule_command(add_ns(step_ns, 1), EVENT_PUMP);
+  atomic_fetch_add(&g_event_pump.deferred, 1);
+}
+
+static void schedule_event_pump(int64_t now_ns) {
+  g_event_pump.slot_ns = add_ns(g_event_pump.slot_ns, g_event_pump.period_ns);
+
+  // skips the slots missed by a long command instead of catching up
+  if (g_event_pump.slot_ns <= now_ns)
+    g_event_pump.slot_ns = add_ns(now_ns, g_event_pump.period_ns);
+
+  int64_t step_ns;
+  if (pump_blocks_step(g_event_pump.slot_ns, &step_ns))
+    defer_event_pump(step_ns);
+  else
+    schedule_command(g_event_pump.slot_ns, EVENT_PUMP);
+}
+
+static void start_event_pump(void) {
+  g_event_pump.postponed = false;
+  g_event_pump.slot_ns = get_monotonic_ns();
+  schedule_command(g_event_pump.slot_ns, EVENT_PUMP);
+}
+
+static void atomic_max(_Atomic int64_t *max, int64_t value) {
+  int64_t current = atomic_load(max);
+  while (value > current &&
+         !atomic_compare_exchange_weak(max, &current, value))
+    ;
+}
+
+// the sdk delivers its events from inside EdsGetEvent on this thread
+static EdsError event_pump_command(void *data) {
+  int64_t start_ns = get_monotonic_ns();
+
+  // the step may have been scheduled after this pump
+  int64_t step_ns;
+  if (!g_event_pump.postponed && pump_blocks_step(start_ns, &step_ns)) {
+    defer_event_pump(step_ns);
+    return EDS_ERR_OK;
+  }
+
+  g_event_pump.postponed = false;
+
+  EdsError err = EdsGetEvent();
+  drain_camera_events(CAMERA_EVENTS_BATCH);
+
+  int64_t end_ns = get_monotonic_ns();
+  int64_t lateness_ns = start_ns - g_event_pump.slot_ns;
+  int64_t duration_ns = end_ns - start_ns;
+
+  atomic_fetch_add(&g_event_pump.pumps, 1);
+  atomic_fetch_add(&g_event_pump.total_lateness_ns, lateness_ns);
+  atomic_fetch_add(&g_event_pump.total_duration_ns, duration_ns);
+  atomic_max(&g_event_pump.max_lateness_ns, lateness_ns);
+  atomic_max(&g_event_pump.max_duration_ns, duration_ns);
+
+  schedule_event_pump(end_ns);
+
+  return err;
+}
 
 static const command_handler_t command_table[] = {
     [NO_OP] = no_op_command,
@@ -572,121 +1431,277 @@ static const command_handler_t command_table[] = {
     [DEINITIALIZE] = deinitialize_command,
     [CONNECT] = connect_command,
     [DISCONNECT] = disconnect_command,
-    [INITIAL_DELAY] = initial_delay_command,
-    [INTERVAL_DELAY] = interval_delay_command,
     [TAKE_PICTURE] = take_picture_command,
-    [TAKE_SINGLE_PICTURE] = take_single_picture_command,
+    [SEQUENCER_STEP] = sequencer_step_command,
+    [SYNC_PROPERTIES] = sync_properties_command,
     [START_SHOOTING] = start_shooting_command,
     [STOP_SHOOTING] = stop_shooting_command,
     [TERMINATE] = terminate_command,
+    [EVENT_PUMP] = event_pump_command,
 };
 
+// stop requests must never wait behind a capture or a slow connect
+static enum queue_lane command_lane(int32_t cmd) {
+  switch (cmd) {
+  case STOP_SHOOTING:
+  case TERMINATE:
+  case DISCONNECT:
+    return QUEUE_LANE_CONTROL;
+  default:
+    return QUEUE_LANE_DATA;
+  }
+}
+
+bool camera_post_command(int32_t cmd, completion_fn notify,
+                         void *notify_data) {
+  void *data = NULL;
+
+  // bumped before posting, so a capture queued earlier can't start between
+  // the post and the stop; connects and settings writes still run
+  if (cmd == STOP_SHOOTING || cmd == DISCONNECT)
+    atomic_fetch_add(&g_command_generation, 1);
+  else if (cmd == TAKE_PICTURE || cmd == START_SHOOTING)
+    data = (void *)(uintptr_t)atomic_load(&g_command_generation);
+
+  return async_queue_post_notify(&g_main_queue, cmd, data, notify,
+                                 notify_data);
+}
+
+static _Atomic(state_listener_fn) g_state_listener = NULL;
+
+void set_state_listener(state_listener_fn listener) {
+  atomic_store(&g_state_listener, listener);
+}
+
+static void notify_state_changed(void) {
+  static uint64_t last_version = 0;
+
+  uint64_t version = get_state_version();
+  if (version == last_version)
+    return;
+
+  last_version = version;
+
+  state_listener_fn listener = atomic_load(&g_state_listener);
+  if (listener != NULL)
+    listener();
+}
+
+static volatile sig_atomic_t g_signal_received = 0;
+
 static void sig_handler(int sig) {
-  disconnect_command(NULL);
-  terminate_command(NULL);
-  // async_queue_post(&g_main_queue, DISCONNECT, /*async*/ true);
-  // async_queue_post(&g_main_queue, TERMINATE, /*async*/ true);
-  exit(0);
+  // only async-signal-safe calls here, the loop does the actual work
+  g_signal_received = sig;
+  async_queue_interrupt(&g_main_queue);
 }
 
-void command_processor(void) {
+void camera_init(void) {
+  assert(async_queue_init(&g_main_queue, command_lane));
+
+  for (uint32_t i = 0; i < CAMERA_EVENTS_SIZE; i++)
+    atomic_init(&g_camera_events.cells[i].sequence, i);
+
   signal(SIGTERM, sig_handler);
   signal(SIGINT, sig_handler);
 
   copy_all_exposures();
   copy_all_isos();
+}
+
+void set_timer_precision(int64_t guard_ns, enum wait_mode mode) {
+  g_timer_guard_ns = guard_ns;
+  g_timer_mode = mode;
+}
+
+// finishes the wait for a timer due within the guard band, commands posted
+// meanwhile wait at most that long
+static void wait_for_timer(int64_t deadline_ns) {
+  int64_t requested_ns = deadline_ns - get_monotonic_ns();
+  int64_t woken_ns =
+      precise_sleep_until_ns(deadline_ns, g_timer_guard_ns, g_timer_mode);
+
+  MG_DEBUG(("Timer wait: requested %lld us, woke up %lld ns late",
+            (long long)(requested_ns / MICRO_TO_NS),
+            (long long)(woken_ns - deadline_ns)));
+}
+
+void command_processor(void) {
+  start_event_pump();
 
   while (g_state.state.running) {
     int32_t cmd = NO_OP;
     void *data = NULL;
 
+    if (g_signal_received) {
+      MG_DEBUG(("Signal %d received", g_signal_received));
+      stop_shooting_command(NULL);
+      disconnect_command(NULL);
+      terminate_command(NULL);
+      break;
+    }
+
+    int64_t now_ns = get_monotonic_ns();
+
+    while (timer_heap_pop_expired(&g_timers, now_ns, &cmd, &data)) {
+      if (cmd != EVENT_PUMP)
+        MG_DEBUG(("Timer: %s", command_names[cmd]));
+      command_table[cmd](data);
+      notify_state_changed();
+    }
+
+    // sleep until the next timer is due or a command arrives, the event
+    // pump keeps one scheduled at all times
+    int64_t timeout_ns = g_event_pump.period_ns;
+    int64_t deadline_ns;
+
+    if (timer_heap_peek(&g_timers, &deadline_ns, &cmd)) {
+      now_ns = get_monotonic_ns();
+
+      // only the shutter timers are worth a busy-wait
+      int64_t guard_ns = g_timer_mode == WAIT_SLEEP || cmd != SEQUENCER_STEP
+                             ? 0
+                             : g_timer_guard_ns;
+      if (deadline_ns - now_ns <= guard_ns) {
+        if (guard_ns > 0)
+          wait_for_timer(deadline_ns);
+        continue;
+      }
+
+      // the queue wait is the coarse sleep, the guard band is spun
+      int64_t coarse_ns = deadline_ns - guard_ns;
+      if (coarse_ns - now_ns < timeout_ns)
+        timeout_ns = coarse_ns - now_ns;
+    }
+
+    struct completion_t *completion = NULL;
+
     int32_t slot = async_queue_dequeue_locked(&g_main_queue, &cmd, &data,
-                                              500 * MILLI_TO_NS);
+                                              &completion, timeout_ns);
 
-    if (slot < 0) {
-      EdsGetEvent();
+    if (slot < 0)
       continue;
-    }
 
     const char *command_name = command_names[cmd];
     command_handler_t handler = command_table[cmd];
 
     MG_DEBUG(("Command: %s on slot %d", command_name, slot));
 
-    handler(data);
+    EdsError err = handler(data);
 
-    async_queue_unlock(&g_main_queue, slot);
+    async_queue_complete(completion, err);
+    notify_state_changed();
   }
 }
 
-void set_exposure_custom(const char *value_str) {
-  assert(pthread_mutex_lock(&g_state.mutex) == 0);
+const char *apply_settings(const struct camera_settings_t *settings) {
+  struct settings_limits_t limits = {
+      .iso_count = g_isos_size,
+      .exposure_count = g_exposures_size,
+      .trigger_latency_ns = get_trigger_latency_ns(),
+  };
+
+  const char *error = validate_settings(settings, &limits);
+  if (error != NULL)
+    return error;
+
+  // readers see either none or all of the new values
+  state_write_begin();
+
+  if (settings->fields & SETTING_DELAY)
+    g_state.state.delay_ns = settings->delay_ns;
+  if (settings->fields & SETTING_INTERVAL)
+    g_state.state.interval_ns = settings->interval_ns;
+  if (settings->fields & SETTING_FRAMES)
+    g_state.state.frames = settings->frames;
+  if (settings->fields & SETTING_ISO_INDEX)
+    g_state.state.iso_index = settings->iso_index;
+  if (settings->fields & SETTING_EXPOSURE_INDEX)
+    g_state.state.exposure_index = settings->exposure_index;
+  if (settings->fields & SETTING_EXPOSURE)
+    g_state.state.exposure_ns = settings->exposure_ns;
+
+  state_write_end();
+
+  return NULL;
+}
 
-  int exposure = 0;
-  if (sscanf(value_str, "%d", &exposure) == 1) {
-    g_state.state.exposure_us = exposure * SEC_TO_US;
-  }
+const char *apply_property_settings(const struct camera_settings_t *settings,
+                                    completion_fn notify, void *notify_data,
+                                    bool *posted) {
+  *posted = false;
 
-  assert(pthread_mutex_unlock(&g_state.mutex) == 0);
-}
+  // raised before the indices change: a property event coming in before
+  // the write would otherwise put the camera's old values back
+  bool was_pending = atomic_exchange(&g_state.properties_pending, true);
 
-void set_exposure_index(const char *index_str) {
-  assert(pthread_mutex_lock(&g_state.mutex) == 0);
+  const char *error = apply_settings(settings);
+  // a sync that started meanwhile lowered it, nothing is queued any more
+  was_pending = was_pending &&
+                atomic_exchange(&g_state.properties_pending, true);
 
-  int32_t index = 0;
-  if (sscanf(index_str, "%d", &index) == 1) {
-    g_state.state.exposure_index = index;
+  if (error == NULL)
+    *posted = async_queue_post_notify(&g_main_queue, SYNC_PROPERTIES, NULL,
+                                      notify, notify_data);
 
-    update_shutter_speed();
-  }
+  // the values stay saved, the camera still holds the old ones
+  if (!*posted && error == NULL)
+    atomic_store(&g_state.properties_saved, true);
+  if (!*posted && !was_pending)
+    atomic_store(&g_state.properties_pending, false);
 
-  assert(pthread_mutex_unlock(&g_state.mutex) == 0);
+  return error;
 }
 
-void set_iso_index(const char *index_str) {
-  assert(pthread_mutex_lock(&g_state.mutex) == 0);
+const char *set_exposure_custom(const char *value_str) {
+  struct camera_settings_t settings = {.fields = SETTING_EXPOSURE};
+  if (!parse_seconds(value_str, &settings.exposure_ns))
+    return "invalid exposure";
 
-  int32_t index = 0;
-  if (sscanf(index_str, "%d", &index) == 1) {
-    g_state.state.iso_index = index;
+  return apply_settings(&settings);
+}
 
-    update_iso_speed();
-  }
+const char *set_exposure_index(const char *index_str, const char **notice) {
+  *notice = NULL;
 
-  assert(pthread_mutex_unlock(&g_state.mutex) == 0);
+  struct camera_settings_t settings = {.fields = SETTING_EXPOSURE_INDEX};
+  if (sscanf(index_str, "%d", &settings.exposure_index) != 1)
+    return "invalid exposure";
+
+  return request_property_sync(&settings, notice);
 }
 
-void set_delay(const char *value_str) {
-  assert(pthread_mutex_lock(&g_state.mutex) == 0);
+const char *set_iso_index(const char *index_str, const char **notice) {
+  *notice = NULL;
 
-  int32_t delay = 0;
-  if (sscanf(value_str, "%d", &delay) == 1) {
-    g_state.state.delay_us = delay * SEC_TO_US;
-  }
+  struct camera_settings_t settings = {.fields = SETTING_ISO_INDEX};
+  if (sscanf(index_str, "%d", &settings.iso_index) != 1)
+    return "invalid iso";
 
-  assert(pthread_mutex_unlock(&g_state.mutex) == 0);
+  return request_property_sync(&settings, notice);
 }
 
-void set_interval(const char *value_str) {
-  assert(pthread_mutex_lock(&g_state.mutex) == 0);
-
-  int32_t interval = 0;
-  if (sscanf(value_str, "%d", &interval) == 1) {
-    g_state.state.interval_us = interval * SEC_TO_US;
-  }
+const char *set_delay(const char *value_str) {
+  struct camera_settings_t settings = {.fields = SETTING_DELAY};
+  if (!parse_seconds(value_str, &settings.delay_ns))
+    return "invalid delay";
 
-  assert(pthread_mutex_unlock(&g_state.mutex) == 0);
+  return apply_settings(&settings);
 }
 
-void set_frames(const char *value_str) {
-  assert(pthread_mutex_lock(&g_state.mutex) == 0);
+const char *set_interval(const char *value_str) {
+  struct camera_settings_t settings = {.fields = SETTING_INTERVAL};
+  if (!parse_seconds(value_str, &settings.interval_ns))
+    return "invalid interval";
 
-  int32_t frames = 0;
-  if (sscanf(value_str, "%d", &frames) == 1) {
-    g_state.state.frames = frames;
-  }
+  return apply_settings(&settings);
+}
 
-  assert(pthread_mutex_unlock(&g_state.mutex) == 0);
+const char *set_frames(const char *value_str) {
+  struct camera_settings_t settings = {.fields = SETTING_FRAMES};
+  if (sscanf(value_str, "%d", &settings.frames) != 1)
+    return "invalid frames";
+
+  return apply_settings(&settings);
 }
 
 void get_exposure_at(int32_t index, char *value_str, size_t size) {
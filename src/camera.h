@@ -10,6 +10,7 @@
 #endif
 
 #include "queue.h"
+#include "settings.h"
 
 #include <EDSDK.h>
 
@@ -19,44 +20,116 @@ enum command_type {
   DEINITIALIZE,
   CONNECT,
   DISCONNECT,
-  INITIAL_DELAY,
-  INTERVAL_DELAY,
   TAKE_PICTURE,
-  TAKE_SINGLE_PICTURE,
-  SET_FRAMES,
+  SEQUENCER_STEP,
+  SYNC_PROPERTIES,
   START_SHOOTING,
   STOP_SHOOTING,
   TERMINATE,
+  EVENT_PUMP,
 };
 
 struct camera_state_t {
+  // bumped on every change, equal versions mean equal snapshots
+  uint64_t version;
+  // bumped when the exposure and iso lists are refilled
+  uint32_t capabilities_version;
   bool running;
   int32_t iso_index;
   int32_t exposure_index;
-  int32_t delay_us;
-  int32_t exposure_us;
-  int32_t interval_us;
+  // durations in nanoseconds
+  int64_t delay_ns;
+  int64_t exposure_ns;
+  int64_t interval_ns;
   int32_t frames;
   int32_t frames_taken;
+  int64_t lateness_ns;
+  int64_t max_lateness_ns;
+  // frame start lateness over the current sequence
+  struct jitter_stats_t trigger_jitter;
   bool initialized;
   bool connected;
   bool shooting;
+  // reported by the camera: images waiting for a transfer, images created
+  // since connecting
+  bool busy;
+  int32_t objects_created;
+  // bumped when a setting is changed on the camera itself, not from here
+  uint32_t camera_changes;
   char description[EDS_MAX_NAME];
 };
 
 extern struct sync_queue_t g_main_queue;
 
+// posts `cmd` without waiting for room in its lane, false when it is full;
+// STOP_SHOOTING and DISCONNECT cancel the TAKE_PICTURE and START_SHOOTING
+// posted before them, which complete with EDS_ERR_OPERATION_CANCELLED
+bool camera_post_command(int32_t cmd, completion_fn notify, void *notify_data);
+
+// called on the command thread whenever a command or timer changed the state
+typedef void (*state_listener_fn)(void);
+
+void camera_init(void);
+void set_state_listener(state_listener_fn listener);
 void command_processor(void);
+// wake-up jitter of a loaded pi is a few ms
+#define TIMER_GUARD_NS (2 * MILLI_TO_NS)
+
+// how timers are waited for, the last guard_ns before a deadline are
+// busy-waited unless mode is WAIT_SLEEP; set before command_processor()
+void set_timer_precision(int64_t guard_ns, enum wait_mode mode);
+
+// EdsGetEvent() cadence, events are delivered from inside it
+#define EVENT_PUMP_NS (20 * MILLI_TO_NS)
+
+struct event_pump_stats_t {
+  int64_t period_ns;
+  uint64_t pumps;
+  // pumps postponed past a shutter deadline
+  uint64_t deferred;
+  // how late a pump ran after its slot, and how long EdsGetEvent() took
+  int64_t total_lateness_ns;
+  int64_t max_lateness_ns;
+  int64_t total_duration_ns;
+  int64_t max_duration_ns;
+  // camera events lost to a full ring
+  uint64_t events_dropped;
+};
+
+// set before command_processor()
+void set_event_pump_period(int64_t period_ns);
+void get_event_pump_stats(struct event_pump_stats_t *stats);
 
 void get_state_copy(struct camera_state_t *state);
+uint64_t get_state_version(void);
 bool is_running(void);
 
-void set_iso_index(const char *index_str);
-void set_exposure_index(const char *index_str);
-void set_exposure_custom(const char *value_str);
-void set_delay(const char *value_str);
-void set_interval(const char *value_str);
-void set_frames(const char *value_str);
+// a property change applied while the command queue was full
+#define SETTINGS_SAVED_NOTICE "camera busy, saved for the next sequence"
+
+// the setters return an error message, NULL when the value was applied;
+// times are in seconds with millisecond resolution. The index setters set
+// *notice when the value was applied but its camera write is still pending
+const char *set_iso_index(const char *index_str, const char **notice);
+const char *set_exposure_index(const char *index_str, const char **notice);
+const char *set_exposure_custom(const char *value_str);
+const char *set_delay(const char *value_str);
+const char *set_interval(const char *value_str);
+const char *set_frames(const char *value_str);
+// validates and applies all the fields at once, returns an error message
+// and changes nothing when a field is invalid; the camera properties are
+// written by a SYNC_PROPERTIES command posted by the caller
+const char *apply_settings(const struct camera_settings_t *settings);
+// apply_settings() for a change touching the camera properties, then posts
+// the SYNC_PROPERTIES writing them, `notify` gets its result; *posted is
+// false when the lane was full, the values are kept and written when the
+// next sequence starts
+const char *apply_property_settings(const struct camera_settings_t *settings,
+                                    completion_fn notify, void *notify_data,
+                                    bool *posted);
+
+// average time spent in shutter commands per frame, 0 until measured
+int64_t get_trigger_latency_ns(void);
 
 void get_exposure_at(int32_t index, char *value_str, size_t size);
 int32_t get_exposure_count(void);
@@ -1,24 +1,179 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "assets.h"
 #include "camera.h"
 #include "mongoose.h"
 #include "queue.h"
+#include "realtime.h"
 #include "timer.h"
 
 typedef void (*http_handler_fn)(struct mg_connection *,
                                 struct mg_http_message *);
 
+enum route_match {
+  ROUTE_EXACT,
+  ROUTE_PREFIX,
+};
+
 struct http_handler_t {
-  const char *endpoint;
+  const char *method;
+  const char *path;
+  enum route_match match;
   http_handler_fn handler;
 };
 
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
+
 #define CONTENT_TYPE_TEXT "Content-Type: text/plain\r\n"
 #define CONTENT_TYPE_HTML "Content-Type: text/html\r\n"
 #define CONTENT_TYPE_JSON "Content-Type: application/json\r\n"
 
 static const char *s_http_addr = "http://0.0.0.0:8001"; // HTTP port
 
+static struct mg_mgr g_mgr;
+
+// what to render once the command a connection is parked on completes
+enum deferred_response {
+  DEFERRED_NONE,
+  DEFERRED_CAMERA,
+  DEFERRED_STATE,
+  DEFERRED_JSON_STATE,
+};
+
+// per connection bookkeeping, stored in mg_connection::data
+struct connection_data_t {
+  uint8_t deferred;
+  bool subscriber;
+};
+
+_Static_assert(sizeof(struct connection_data_t) <= MG_DATA_SIZE,
+               "connection data too big");
+
+static struct connection_data_t *connection_data(struct mg_connection *c) {
+  return (struct connection_data_t *)c->data;
+}
+
+// the listening connection receives the state change wakeups
+static _Atomic unsigned long g_listener_id = 0;
+
+// last state pushed to the event stream subscribers
+static struct camera_state_t g_published_state;
+
+static void publish_state(void);
+
+#define CONTENT_TYPE_EVENT_STREAM                                              \
+  "Content-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+
+// rendered markup is kept until the state it was rendered from changes
+struct fragment_key_t {
+  uint64_t version; // 0 for fragments that only depend on the fields below
+  uint32_t capabilities_version;
+  int32_t selected;
+  int64_t value;
+  bool enabled;
+};
+
+struct fragment_cache_t {
+  struct fragment_key_t key;
+  bool valid;
+  struct mg_iobuf html;
+};
+
+// grow the buffers in large steps, mg_pfn_iobuf appends a char at a time
+#define FRAGMENT_CACHE_INITIALIZER {.valid = false, .html = {.align = 1024}}
+
+static struct fragment_cache_t g_exposure_cache = FRAGMENT_CACHE_INITIALIZER;
+static struct fragment_cache_t g_iso_cache = FRAGMENT_CACHE_INITIALIZER;
+static struct fragment_cache_t g_content_cache = FRAGMENT_CACHE_INITIALIZER;
+
+static bool fragment_key_equal(const struct fragment_key_t *a,
+                               const struct fragment_key_t *b) {
+  return a->version == b->version &&
+         a->capabilities_version == b->capabilities_version &&
+         a->selected == b->selected && a->value == b->value &&
+         a->enabled == b->enabled;
+}
+
+// only the event loop thread renders, so the caches need no locking
+static size_t render_cached(mg_pfn_t out, void *ptr, va_list *ap) {
+  struct fragment_cache_t *cache = va_arg(*ap, struct fragment_cache_t *);
+  const struct fragment_key_t *key = va_arg(*ap, const struct fragment_key_t *);
+  mg_pm_t render = va_arg(*ap, mg_pm_t);
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  if (!cache->valid || !fragment_key_equal(&cache->key, key)) {
+    cache->html.len = 0;
+    mg_xprintf(mg_pfn_iobuf, &cache->html, "%M", render, state);
+    cache->key = *key;
+    cache->valid = true;
+  }
+
+  return mg_xprintf(out, ptr, "%.*s", (int)cache->html.len,
+                    (const char *)cache->html.buf);
+}
+
+static void fragment_cache_free(struct fragment_cache_t *cache) {
+  mg_iobuf_free(&cache->html);
+  cache->valid = false;
+}
+
+// distinguishes the versions of this process from the ones of a previous run
+static uint32_t g_etag_epoch = 0;
+
+#define ETAG_SIZE 32
+
+static void state_etag(const struct camera_state_t *state, char *etag,
+                       size_t size) {
+  mg_snprintf(etag, size, "\"%x-%llx\"", g_etag_epoch,
+              (unsigned long long)state->version);
+}
+
+static bool str_contains(struct mg_str haystack, const char *needle) {
+  size_t len = strlen(needle);
+  for (size_t i = 0; i + len <= haystack.len; i++) {
+    if (memcmp(haystack.buf + i, needle, len) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+static bool etag_matches(struct mg_http_message *hm, const char *etag) {
+  struct mg_str *if_none_match = mg_http_get_header(hm, "If-None-Match");
+  if (if_none_match == NULL)
+    return false;
+
+  if (mg_strcmp(*if_none_match, mg_str("*")) == 0)
+    return true;
+
+  // the header may carry a list of tags
+  return str_contains(*if_none_match, etag);
+}
+
+// replies 304 when the client already has this version of the state,
+// otherwise fills the headers of the 200 response
+static bool not_modified(struct mg_connection *c, struct mg_http_message *hm,
+                         const struct camera_state_t *state,
+                         const char *content_type, char *headers,
+                         size_t size) {
+  char etag[ETAG_SIZE];
+  state_etag(state, etag, sizeof(etag));
+
+  mg_snprintf(headers, size, "%sCache-Control: no-cache\r\nETag: %s\r\n",
+              content_type, etag);
+
+  if (!etag_matches(hm, etag))
+    return false;
+
+  mg_http_reply(c, 304, headers, "");
+  return true;
+}
+
 static void not_found(struct mg_connection *c) {
   mg_http_reply(c, 404, CONTENT_TYPE_TEXT, "Not Found");
 }
@@ -81,39 +236,75 @@ static bool inputs_enabled(const struct camera_state_t *state) {
 
 struct input_t {
   const char *id;
-  int32_t value;
+  int64_t value;
+  bool seconds; // value in ns, shown in seconds with millisecond resolution
   bool enabled;
+  const char *error; // why the last submitted value was rejected
 };
 
+// "1", "1.5", "0.25"
+static void format_seconds(char *buf, size_t size, int64_t value_ns) {
+  long long ms = value_ns / MILLI_TO_NS;
+
+  if (ms % 1000 == 0) {
+    mg_snprintf(buf, size, "%lld", ms / 1000);
+    return;
+  }
+
+  size_t len = mg_snprintf(buf, size, "%lld.%03d", ms / 1000, (int)(ms % 1000));
+  while (len > 0 && buf[len - 1] == '0')
+    buf[--len] = '\0';
+}
+
 static size_t render_input(mg_pfn_t out, void *ptr, va_list *ap) {
   const struct input_t *input = va_arg(*ap, const struct input_t *);
 
-  return mg_xprintf(out, ptr,
-                    "<input type=\"number\" name=\"%s\" value=\"%d\" "
-                    "  class=\"input-%s\" required hx-validate=\"true\" "
-                    "  min=\"0\" inputmode=\"numeric\" "
-                    "  hx-post=\"/api/camera/state/%s\" "
-                    "  hx-swap=\"outerHTML\" %s />",
-                    input->id, input->value, input->id, input->id,
-                    input->enabled ? "" : "disabled");
+  char value[32];
+  if (input->seconds)
+    format_seconds(value, sizeof(value), input->value);
+  else
+    mg_snprintf(value, sizeof(value), "%lld", (long long)input->value);
+
+  return mg_xprintf(
+      out, ptr,
+      "<input type=\"number\" name=\"%s\" value=\"%s\" "
+      "  class=\"input-%s%s\" required hx-validate=\"true\" "
+      "  min=\"0\" step=\"%s\" inputmode=\"%s\" title=%m "
+      "  hx-post=\"/api/camera/state/%s\" "
+      "  hx-swap=\"outerHTML\" %s />",
+      input->id, value, input->id, input->error != NULL ? " invalid" : "",
+      input->seconds ? "0.001" : "1", input->seconds ? "decimal" : "numeric",
+      MG_ESC(input->error != NULL ? input->error : ""), input->id,
+      input->enabled ? "" : "disabled");
 }
 
-static size_t render_exposure(mg_pfn_t out, void *ptr, va_list *ap) {
+// a rejected value is flagged on the field it came from, the custom input
+// when it is shown, the select otherwise; a notice about an applied value
+// only goes into the select's title
+static size_t render_exposure_fields(mg_pfn_t out, void *ptr, va_list *ap) {
   const struct camera_state_t *state =
       va_arg(*ap, const struct camera_state_t *);
+  const char *error = va_arg(*ap, const char *);
+  const char *notice = va_arg(*ap, const char *);
 
   char value[32] = {0};
 
   size_t size = 0;
+  int32_t exposure_count = get_exposure_count();
+
+  bool is_custom = state->exposure_index >= exposure_count;
+  bool select_invalid = error != NULL && !is_custom;
+  bool custom_invalid = error != NULL && is_custom;
+  const char *select_title =
+      select_invalid ? error : (notice != NULL ? notice : "");
+
   size += mg_xprintf(out, ptr, "<div class=\"input-exposure\">");
   size += mg_xprintf(
       out, ptr,
       "<select name=\"exposure\" hx-post=\"/api/camera/state/exposure\" "
-      "  hx-swap=\"outerHTML\" hx-target=\".input-exposure\">");
-
-  int32_t exposure_count = get_exposure_count();
-
-  bool is_custom = state->exposure_index >= exposure_count;
+      "  class=\"%s\" title=%m "
+      "  hx-swap=\"outerHTML\" hx-target=\".input-exposure\">",
+      select_invalid ? "invalid" : "", MG_ESC(select_title));
 
   size += mg_xprintf(out, ptr, "<option value=\"%d\" %s>Custom</option>",
                      exposure_count, is_custom ? "selected" : "");
@@ -129,13 +320,16 @@ static size_t render_exposure(mg_pfn_t out, void *ptr, va_list *ap) {
   size += mg_xprintf(out, ptr, "</select>");
 
   if (is_custom) {
+    format_seconds(value, sizeof(value), state->exposure_ns);
     size += mg_xprintf(
         out, ptr,
-        "<input type=\"text\" name=\"exposure-custom\" value=\"%d\" required "
-        "  hx-validate=\"true\" min=\"0\" inputmode=\"numeric\" "
+        "<input type=\"text\" name=\"exposure-custom\" value=\"%s\" required "
+        "  hx-validate=\"true\" min=\"0\" inputmode=\"decimal\" "
+        "  class=\"%s\" title=%m "
         "  hx-post=\"/api/camera/state/exposure\" "
         "  hx-swap=\"outerHTML\" hx-target=\".input-exposure\" %s />",
-        (int32_t)(state->exposure_us / SEC_TO_US),
+        value, custom_invalid ? "invalid" : "",
+        MG_ESC(custom_invalid ? error : ""),
         inputs_enabled(state) ? "" : "disabled");
   }
 
@@ -144,17 +338,46 @@ static size_t render_exposure(mg_pfn_t out, void *ptr, va_list *ap) {
   return size;
 }
 
-static size_t render_iso(mg_pfn_t out, void *ptr, va_list *ap) {
+static size_t render_exposure_html(mg_pfn_t out, void *ptr, va_list *ap) {
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  return mg_xprintf(out, ptr, "%M", render_exposure_fields, state,
+                    (const char *)NULL, (const char *)NULL);
+}
+
+static size_t render_exposure(mg_pfn_t out, void *ptr, va_list *ap) {
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  struct fragment_key_t key = {
+      .version = 0,
+      .capabilities_version = state->capabilities_version,
+      .selected = state->exposure_index,
+      .value = state->exposure_ns,
+      .enabled = inputs_enabled(state),
+  };
+
+  return mg_xprintf(out, ptr, "%M", render_cached, &g_exposure_cache, &key,
+                    render_exposure_html, state);
+}
+
+// like render_exposure_fields(), a rejected index flags the select
+static size_t render_iso_fields(mg_pfn_t out, void *ptr, va_list *ap) {
   const struct camera_state_t *state =
       va_arg(*ap, const struct camera_state_t *);
+  const char *error = va_arg(*ap, const char *);
+  const char *notice = va_arg(*ap, const char *);
 
   char value[32] = {0};
+  const char *title = error != NULL ? error : (notice != NULL ? notice : "");
 
   size_t size = 0;
   size += mg_xprintf(out, ptr,
-                     "<select class=\"input-iso\" name=\"iso\" "
+                     "<select class=\"input-iso%s\" name=\"iso\" title=%m "
                      "  hx-post=\"/api/camera/state/iso\" "
-                     "  hx-swap=\"outerHTML\" hx-target=\".input-iso\">");
+                     "  hx-swap=\"outerHTML\" hx-target=\".input-iso\">",
+                     error != NULL ? " invalid" : "", MG_ESC(title));
 
   int32_t iso_count = get_iso_count();
 
@@ -171,6 +394,30 @@ static size_t render_iso(mg_pfn_t out, void *ptr, va_list *ap) {
   return size;
 }
 
+static size_t render_iso_html(mg_pfn_t out, void *ptr, va_list *ap) {
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  return mg_xprintf(out, ptr, "%M", render_iso_fields, state,
+                    (const char *)NULL, (const char *)NULL);
+}
+
+static size_t render_iso(mg_pfn_t out, void *ptr, va_list *ap) {
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  struct fragment_key_t key = {
+      .version = 0,
+      .capabilities_version = state->capabilities_version,
+      .selected = state->iso_index,
+      .value = 0,
+      .enabled = true,
+  };
+
+  return mg_xprintf(out, ptr, "%M", render_cached, &g_iso_cache, &key,
+                    render_iso_html, state);
+}
+
 static size_t render_inputs_content(mg_pfn_t out, void *ptr, va_list *ap) {
   const struct camera_state_t *state =
       va_arg(*ap, const struct camera_state_t *);
@@ -179,18 +426,24 @@ static size_t render_inputs_content(mg_pfn_t out, void *ptr, va_list *ap) {
 
   struct input_t delay = {
       .id = "delay",
-      .value = state->delay_us / SEC_TO_US,
+      .value = state->delay_ns,
+      .seconds = true,
       .enabled = enabled,
+      .error = NULL,
   };
   struct input_t interval = {
       .id = "interval",
-      .value = state->interval_us / SEC_TO_US,
+      .value = state->interval_ns,
+      .seconds = true,
       .enabled = enabled,
+      .error = NULL,
   };
   struct input_t frames = {
       .id = "frames",
       .value = state->frames,
+      .seconds = false,
       .enabled = enabled,
+      .error = NULL,
   };
 
   return mg_xprintf(out, ptr,
@@ -255,267 +508,988 @@ static size_t render_actions_content(mg_pfn_t out, void *ptr, va_list *ap) {
         !enabled ? "disabled" : "");
   }
 
+  // kept up to date by the event stream in index.js
+  size += mg_xprintf(out, ptr,
+                     "<span class=\"progress\">"
+                     "<span class=\"frames-taken\">%d</span> / "
+                     "<span class=\"frames-total\">%d</span>"
+                     "</span>",
+                     state->frames_taken, state->frames);
+
   size += mg_xprintf(out, ptr, "</div>");
 
   return size;
 }
 
-static size_t render_content(mg_pfn_t out, void *ptr, va_list *ap) {
+static size_t render_content_html(mg_pfn_t out, void *ptr, va_list *ap) {
   const struct camera_state_t *state =
       va_arg(*ap, const struct camera_state_t *);
 
-  const char *refresh = state->shooting
-                            ? "hx-get=\"/api/camera/state\" "
-                              "hx-swap=\"outerHTML\" hx-trigger=\"every 2s\""
-                            : "";
-
-  return mg_xprintf(out, ptr, "<div class=\"content\" %s>%M%M%M</div>", refresh,
+  return mg_xprintf(out, ptr, "<div class=\"content\">%M%M%M</div>",
                     render_camera_content, state, render_inputs_content, state,
                     render_actions_content, state);
 }
 
+static size_t render_content(mg_pfn_t out, void *ptr, va_list *ap) {
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  // the version covers every field of the state
+  struct fragment_key_t key = {
+      .version = state->version,
+      .capabilities_version = state->capabilities_version,
+      .selected = 0,
+      .value = 0,
+      .enabled = true,
+  };
+
+  return mg_xprintf(out, ptr, "%M", render_cached, &g_content_cache, &key,
+                    render_content_html, state);
+}
+
+static const struct asset_t *asset_find(struct mg_str path) {
+  for (int32_t i = 0; i < g_assets_len; i++) {
+    if (mg_strcmp(path, mg_str(g_assets[i].path)) == 0)
+      return &g_assets[i];
+  }
+
+  return NULL;
+}
+
+// appended to the asset urls, a new build gets new urls and the immutable
+// cached copies are never reused
+static const char *asset_version(const char *path) {
+  const struct asset_t *asset = asset_find(mg_str(path));
+  return asset != NULL ? asset->hash : "";
+}
+
 static void render_index_html_response(struct mg_connection *c,
                                        struct mg_http_message *hm) {
   struct camera_state_t state;
   get_state_copy(&state);
 
-  mg_http_reply(c, 200, CONTENT_TYPE_HTML,
+  char headers[128];
+  if (not_modified(c, hm, &state, CONTENT_TYPE_HTML, headers, sizeof(headers)))
+    return;
+
+  mg_http_reply(c, 200, headers,
                 "<!doctype html>"
                 "<html lang=\"en\">"
                 "<head>"
                 "  <meta name=\"viewport\" content=\"width=device-width, "
                 "    initial-scale=1.0\" />"
-                "  <link rel=\"stylesheet\" href=\"assets/index.css\">"
-                "  <script src=\"assets/htmx.min.js\"></script>"
-                "  <script src=\"assets/index.js\"></script>"
+                "  <link rel=\"stylesheet\" href=\"assets/index.css?v=%s\">"
+                "  <script src=\"assets/htmx.min.js?v=%s\"></script>"
+                "  <script src=\"assets/index.js?v=%s\"></script>"
                 "</head>"
                 "<body>%M</body>"
                 "</html>",
-                render_content, &state);
+                asset_version("/assets/index.css"),
+                asset_version("/assets/htmx.min.js"),
+                asset_version("/assets/index.js"), render_content, &state);
 }
 
-static void render_state_response(struct mg_connection *c, bool no_content) {
+static void render_state_response(struct mg_connection *c) {
   struct camera_state_t state;
   get_state_copy(&state);
 
-  if (no_content && state.shooting) {
-    mg_http_reply(c, 204, CONTENT_TYPE_HTML, "No Content");
-  } else {
-    mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_content, &state);
-  }
+  mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_content, &state);
 }
 
-static void render_input_response(struct mg_connection *c, const char *variable,
-                                  int32_t value, bool enabled) {
-  struct input_t input = {
-      .id = variable,
-      .value = value,
-      .enabled = enabled,
-  };
-  mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_input, &input);
+static void render_input_response(struct mg_connection *c,
+                                  const struct input_t *input) {
+  mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_input, input);
 }
 
 static void handle_input_exposure(struct mg_connection *c,
                                   struct mg_http_message *hm) {
   char buf[32];
-  if (mg_http_get_var(&hm->body, "exposure", buf, sizeof(buf)) > 0) {
-    set_exposure_index(buf);
-  }
+  const char *error = NULL;
+  const char *notice = NULL;
+  if (mg_http_get_var(&hm->body, "exposure", buf, sizeof(buf)) > 0)
+    error = set_exposure_index(buf, &notice);
 
-  if (mg_http_get_var(&hm->body, "exposure-custom", buf, sizeof(buf)) > 0) {
-    set_exposure_custom(buf);
-  }
+  // a saved index is still applied, the custom value goes with it
+  if (error == NULL &&
+      mg_http_get_var(&hm->body, "exposure-custom", buf, sizeof(buf)) > 0)
+    error = set_exposure_custom(buf);
 
   struct camera_state_t state;
   get_state_copy(&state);
-  mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_exposure, &state);
+
+  // a flagged field is rendered once, outside the fragment cache
+  if (error != NULL || notice != NULL)
+    mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_exposure_fields,
+                  &state, error, notice);
+  else
+    mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_exposure, &state);
 }
 
 static void handle_input_iso(struct mg_connection *c,
                              struct mg_http_message *hm) {
   char buf[32];
-  if (mg_http_get_var(&hm->body, "iso", buf, sizeof(buf)) > 0) {
-    set_iso_index(buf);
-  }
+  const char *error = NULL;
+  const char *notice = NULL;
+  if (mg_http_get_var(&hm->body, "iso", buf, sizeof(buf)) > 0)
+    error = set_iso_index(buf, &notice);
 
   struct camera_state_t state;
   get_state_copy(&state);
-  mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_iso, &state);
+
+  if (error != NULL || notice != NULL)
+    mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_iso_fields, &state,
+                  error, notice);
+  else
+    mg_http_reply(c, 200, CONTENT_TYPE_HTML, "%M", render_iso, &state);
 }
 
 static void handle_input_delay(struct mg_connection *c,
                                struct mg_http_message *hm) {
   char buf[32];
+  const char *error = NULL;
   if (mg_http_get_var(&hm->body, "delay", buf, sizeof(buf)) > 0)
-    set_delay(buf);
+    error = set_delay(buf);
 
   struct camera_state_t state;
   get_state_copy(&state);
-  render_input_response(c, "delay", state.delay_us / SEC_TO_US,
-                        inputs_enabled(&state));
+
+  struct input_t input = {
+      .id = "delay",
+      .value = state.delay_ns,
+      .seconds = true,
+      .enabled = inputs_enabled(&state),
+      .error = error,
+  };
+  render_input_response(c, &input);
 }
 
 static void handle_input_interval(struct mg_connection *c,
                                   struct mg_http_message *hm) {
   char buf[32];
+  const char *error = NULL;
   if (mg_http_get_var(&hm->body, "interval", buf, sizeof(buf)) > 0)
-    set_interval(buf);
+    error = set_interval(buf);
 
   struct camera_state_t state;
   get_state_copy(&state);
-  render_input_response(c, "interval", state.interval_us / SEC_TO_US,
-                        inputs_enabled(&state));
+
+  // a rejected interval keeps the previous value and is flagged
+  struct input_t input = {
+      .id = "interval",
+      .value = state.interval_ns,
+      .seconds = true,
+      .enabled = inputs_enabled(&state),
+      .error = error,
+  };
+  render_input_response(c, &input);
 }
 
 static void handle_input_frames(struct mg_connection *c,
                                 struct mg_http_message *hm) {
   char buf[32];
+  const char *error = NULL;
   if (mg_http_get_var(&hm->body, "frames", buf, sizeof(buf)) > 0)
-    set_frames(buf);
+    error = set_frames(buf);
+
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  struct input_t input = {
+      .id = "frames",
+      .value = state.frames,
+      .seconds = false,
+      .enabled = inputs_enabled(&state),
+      .error = error,
+  };
+  render_input_response(c, &input);
+}
+
+// runs on the command thread, only the connection id crosses threads
+static void wakeup_connection(int32_t result, void *data) {
+  unsigned long conn_id = (unsigned long)(uintptr_t)data;
+  mg_wakeup(&g_mgr, conn_id, &result, sizeof(result));
+}
+
+static void render_json_error(struct mg_connection *c, int status,
+                              const char *error);
+static void render_json_result_response(struct mg_connection *c,
+                                        int32_t result);
+
+// parks the connection until the command completes instead of blocking the
+// event loop, the response is rendered on MG_EV_WAKEUP; a full queue is
+// answered right away rather than waited on
+static void post_deferred(struct mg_connection *c, int32_t cmd,
+                          enum deferred_response response) {
+  connection_data(c)->deferred = response;
+
+  if (camera_post_command(cmd, wakeup_connection, (void *)(uintptr_t)c->id))
+    return;
+
+  connection_data(c)->deferred = DEFERRED_NONE;
+
+  if (response == DEFERRED_JSON_STATE)
+    render_json_error(c, 409, "command queue full");
+  else
+    mg_http_reply(c, 503, "Retry-After: 1\r\n", "Command queue full\n");
+}
+
+static void render_deferred_response(struct mg_connection *c,
+                                     struct mg_str *wakeup) {
+  enum deferred_response response = connection_data(c)->deferred;
+  connection_data(c)->deferred = DEFERRED_NONE;
+
+  int32_t result = 0;
+  if (wakeup->len == sizeof(result))
+    memcpy(&result, wakeup->buf, sizeof(result));
+
+  switch (response) {
+  case DEFERRED_CAMERA:
+    render_camera_response(c);
+    break;
+  case DEFERRED_STATE:
+    render_state_response(c);
+    break;
+  case DEFERRED_JSON_STATE:
+    render_json_result_response(c, result);
+    break;
+  case DEFERRED_NONE:
+    break;
+  }
+}
+
+// only the fields that changed since the last event are sent
+static size_t render_state_delta(mg_pfn_t out, void *ptr, va_list *ap) {
+  const struct camera_state_t *prev =
+      va_arg(*ap, const struct camera_state_t *);
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  size_t size = 0;
+  const char *sep = "";
+
+  size += mg_xprintf(out, ptr, "{");
+
+#define DELTA_FIELD(name, fmt, value)                                          \
+  if (prev == NULL || prev->name != state->name) {                             \
+    size += mg_xprintf(out, ptr, "%s%m:" fmt, sep, MG_ESC(#name), value);      \
+    sep = ",";                                                                 \
+  }
+
+  DELTA_FIELD(initialized, "%s", state->initialized ? "true" : "false");
+  DELTA_FIELD(connected, "%s", state->connected ? "true" : "false");
+  DELTA_FIELD(shooting, "%s", state->shooting ? "true" : "false");
+  DELTA_FIELD(frames, "%d", state->frames);
+  DELTA_FIELD(frames_taken, "%d", state->frames_taken);
+  DELTA_FIELD(lateness_ns, "%lld", (long long)state->lateness_ns);
+  DELTA_FIELD(max_lateness_ns, "%lld", (long long)state->max_lateness_ns);
+  DELTA_FIELD(iso_index, "%d", state->iso_index);
+  DELTA_FIELD(exposure_index, "%d", state->exposure_index);
+  DELTA_FIELD(busy, "%s", state->busy ? "true" : "false");
+  DELTA_FIELD(objects_created, "%d", state->objects_created);
+  DELTA_FIELD(camera_changes, "%u", state->camera_changes);
+
+#undef DELTA_FIELD
+
+  size += mg_xprintf(out, ptr, "}");
+
+  return size;
+}
+
+// runs on the command thread
+static void wakeup_listener(void) {
+  unsigned long listener_id = atomic_load(&g_listener_id);
+  mg_wakeup(&g_mgr, listener_id, "", 0);
+}
+
+// one state change fans out to every subscriber with the same delta
+static void publish_state(void) {
+  if (get_state_version() == g_published_state.version)
+    return;
 
   struct camera_state_t state;
   get_state_copy(&state);
-  render_input_response(c, "frames", state.frames, inputs_enabled(&state));
+
+  char delta[512];
+  size_t len = mg_snprintf(delta, sizeof(delta), "%M", render_state_delta,
+                           &g_published_state, &state);
+
+  memcpy(&g_published_state, &state, sizeof(struct camera_state_t));
+
+  if (len <= 2) // "{}"
+    return;
+
+  for (struct mg_connection *c = g_mgr.conns; c != NULL; c = c->next) {
+    if (connection_data(c)->subscriber)
+      mg_printf(c, "data: %s\n\n", delta);
+  }
+}
+
+static void handle_get_events(struct mg_connection *c,
+                              struct mg_http_message *hm) {
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  connection_data(c)->subscriber = true;
+
+  mg_printf(c, "HTTP/1.1 200 OK\r\n" CONTENT_TYPE_EVENT_STREAM "\r\n");
+  mg_printf(c, "data: %M\n\n", render_state_delta, NULL, &state);
 }
 
 static void handle_get_camera(struct mg_connection *c,
                               struct mg_http_message *hm) {
-  async_queue_post(&g_main_queue, INITIALIZE, NULL, /*async*/ false);
-  render_camera_response(c);
+  post_deferred(c, INITIALIZE, DEFERRED_CAMERA);
 }
 
 static void handle_get_state(struct mg_connection *c,
                              struct mg_http_message *hm) {
-  render_state_response(c, true);
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  char headers[128];
+  if (not_modified(c, hm, &state, CONTENT_TYPE_HTML, headers, sizeof(headers)))
+    return;
+
+  mg_http_reply(c, 200, headers, "%M", render_content, &state);
 }
 
 static void handle_camera_connect(struct mg_connection *c,
                                   struct mg_http_message *hm) {
-  async_queue_post(&g_main_queue, CONNECT, NULL, /*async*/ false);
-  render_state_response(c, false);
+  post_deferred(c, CONNECT, DEFERRED_STATE);
 }
 
 static void handle_camera_disconnect(struct mg_connection *c,
                                      struct mg_http_message *hm) {
-  async_queue_post(&g_main_queue, DISCONNECT, NULL, /*async*/ false);
-  render_state_response(c, false);
+  post_deferred(c, DISCONNECT, DEFERRED_STATE);
 }
 
 static void handle_camera_start_shoot(struct mg_connection *c,
                                       struct mg_http_message *hm) {
-  async_queue_post(&g_main_queue, START_SHOOTING, NULL, /*async*/ false);
-  render_state_response(c, false);
+  post_deferred(c, START_SHOOTING, DEFERRED_STATE);
 }
 
 static void handle_camera_stop_shoot(struct mg_connection *c,
                                      struct mg_http_message *hm) {
-  async_queue_post(&g_main_queue, STOP_SHOOTING, NULL, /*async*/ true);
-  render_state_response(c, false);
+  post_deferred(c, STOP_SHOOTING, DEFERRED_STATE);
 }
 
 static void handle_camera_take_picture(struct mg_connection *c,
                                        struct mg_http_message *hm) {
-  async_queue_post(&g_main_queue, TAKE_PICTURE, NULL, /*async*/ false);
-  render_state_response(c, false);
+  post_deferred(c, TAKE_PICTURE, DEFERRED_STATE);
+}
+
+#define JSON_BOOL(value) ((value) ? "true" : "false")
+
+// the json renderers print straight into the connection send buffer through
+// mg_http_reply, nothing is allocated per request
+static size_t render_json_state(mg_pfn_t out, void *ptr, va_list *ap) {
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  return mg_xprintf(
+      out, ptr,
+      "{%m:%llu,%m:%s,%m:%s,%m:%s,%m:%s,%m:%m,%m:%d,%m:%d,%m:%lld,%m:%lld,"
+      "%m:%lld,%m:%d,%m:%d,%m:%lld,%m:%lld,%m:%s,%m:%d,%m:%u}",
+      MG_ESC("version"), (unsigned long long)state->version, MG_ESC("running"),
+      JSON_BOOL(state->running), MG_ESC("initialized"),
+      JSON_BOOL(state->initialized), MG_ESC("connected"),
+      JSON_BOOL(state->connected), MG_ESC("shooting"),
+      JSON_BOOL(state->shooting), MG_ESC("description"),
+      MG_ESC(state->description), MG_ESC("iso_index"), state->iso_index,
+      MG_ESC("exposure_index"), state->exposure_index, MG_ESC("delay_ns"),
+      (long long)state->delay_ns, MG_ESC("exposure_ns"),
+      (long long)state->exposure_ns, MG_ESC("interval_ns"),
+      (long long)state->interval_ns, MG_ESC("frames"), state->frames,
+      MG_ESC("frames_taken"), state->frames_taken, MG_ESC("lateness_ns"),
+      (long long)state->lateness_ns, MG_ESC("max_lateness_ns"),
+      (long long)state->max_lateness_ns, MG_ESC("busy"), JSON_BOOL(state->busy),
+      MG_ESC("objects_created"), state->objects_created,
+      MG_ESC("camera_changes"), state->camera_changes);
+}
+
+typedef void (*option_at_fn)(int32_t index, char *value_str, size_t size);
+
+static size_t render_json_options(mg_pfn_t out, void *ptr, va_list *ap) {
+  int32_t count = va_arg(*ap, int32_t);
+  option_at_fn option_at = va_arg(*ap, option_at_fn);
+
+  char value[32] = {0};
+  size_t size = 0;
+
+  size += mg_xprintf(out, ptr, "[");
+
+  for (int32_t i = 0; i < count; i++) {
+    option_at(i, value, sizeof(value));
+    size += mg_xprintf(out, ptr, "%s{%m:%d,%m:%m}", i > 0 ? "," : "",
+                       MG_ESC("index"), i, MG_ESC("description"),
+                       MG_ESC(value));
+  }
+
+  size += mg_xprintf(out, ptr, "]");
+
+  return size;
+}
+
+// index past the end of the exposures selects bulb with exposure_ns
+static size_t render_json_capabilities(mg_pfn_t out, void *ptr, va_list *ap) {
+  const struct camera_state_t *state =
+      va_arg(*ap, const struct camera_state_t *);
+
+  return mg_xprintf(out, ptr, "{%m:%u,%m:%d,%m:%M,%m:%M}",
+                    MG_ESC("capabilities_version"),
+                    state->capabilities_version, MG_ESC("bulb_index"),
+                    get_exposure_count(), MG_ESC("exposures"),
+                    render_json_options, get_exposure_count(),
+                    get_exposure_at, MG_ESC("isos"), render_json_options,
+                    get_iso_count(), get_iso_at);
+}
+
+static size_t render_json_stats(mg_pfn_t out, void *ptr, va_list *ap) {
+  static const char *lane_names[QUEUE_LANES] = {
+      [QUEUE_LANE_CONTROL] = "control",
+      [QUEUE_LANE_DATA] = "data",
+  };
+
+  size_t size = 0;
+
+  size += mg_xprintf(out, ptr, "{%m:{", MG_ESC("lanes"));
+
+  for (int32_t lane = 0; lane < QUEUE_LANES; lane++) {
+    struct queue_lane_stats_t stats;
+    queue_get_stats(&g_main_queue.queue, lane, &stats);
+
+    size += mg_xprintf(
+        out, ptr, "%s%m:{%m:%u,%m:%u,%m:%llu,%m:%lld,%m:%lld}",
+        lane > 0 ? "," : "", MG_ESC(lane_names[lane]), MG_ESC("depth"),
+        stats.depth, MG_ESC("max_depth"), stats.max_depth,
+        MG_ESC("dispatched"), (unsigned long long)stats.dispatched,
+        MG_ESC("total_wait_ns"), (long long)stats.total_wait_ns,
+        MG_ESC("max_wait_ns"), (long long)stats.max_wait_ns);
+  }
+
+  struct camera_state_t state;
+  get_state_copy(&state);
+  const struct jitter_stats_t *jitter = &state.trigger_jitter;
+
+  size += mg_xprintf(
+      out, ptr, "},%m:{%m:%d,%m:%lld,%m:%lld,%m:%lld,%m:%lld}",
+      MG_ESC("trigger_jitter"), MG_ESC("frames"), jitter->count,
+      MG_ESC("min_ns"), (long long)jitter->min_ns, MG_ESC("mean_ns"),
+      (long long)jitter->mean_ns, MG_ESC("max_ns"), (long long)jitter->max_ns,
+      MG_ESC("stddev_ns"), (long long)jitter_stats_stddev_ns(jitter));
+
+  struct event_pump_stats_t pump;
+  get_event_pump_stats(&pump);
+
+  size += mg_xprintf(
+      out, ptr,
+      ",%m:{%m:%lld,%m:%llu,%m:%llu,%m:%lld,%m:%lld,%m:%lld,%m:%lld,%m:%llu},"
+      "%m:%d}",
+      MG_ESC("event_pump"), MG_ESC("period_ns"), (long long)pump.period_ns,
+      MG_ESC("pumps"), (unsigned long long)pump.pumps, MG_ESC("deferred"),
+      (unsigned long long)pump.deferred, MG_ESC("total_lateness_ns"),
+      (long long)pump.total_lateness_ns, MG_ESC("max_lateness_ns"),
+      (long long)pump.max_lateness_ns, MG_ESC("total_duration_ns"),
+      (long long)pump.total_duration_ns, MG_ESC("max_duration_ns"),
+      (long long)pump.max_duration_ns, MG_ESC("events_dropped"),
+      (unsigned long long)pump.events_dropped, MG_ESC("realtime_cpu"),
+      realtime_cpu());
+
+  return size;
+}
+
+static void render_json_error(struct mg_connection *c, int status,
+                              const char *error) {
+  mg_http_reply(c, status, CONTENT_TYPE_JSON, "{%m:%m}", MG_ESC("error"),
+                MG_ESC(error));
+}
+
+static void render_json_result_response(struct mg_connection *c,
+                                        int32_t result) {
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  mg_http_reply(c, result == EDS_ERR_OK ? 200 : 409, CONTENT_TYPE_JSON,
+                "{%m:%d,%m:%M}", MG_ESC("result"), result, MG_ESC("state"),
+                render_json_state, &state);
+}
+
+// applied, but the camera write couldn't be queued
+static void render_json_saved_response(struct mg_connection *c) {
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  mg_http_reply(c, 202, CONTENT_TYPE_JSON, "{%m:%d,%m:%m,%m:%M}",
+                MG_ESC("result"), EDS_ERR_OK, MG_ESC("notice"),
+                MG_ESC(SETTINGS_SAVED_NOTICE), MG_ESC("state"),
+                render_json_state, &state);
+}
+
+static void handle_v1_get_state(struct mg_connection *c,
+                                struct mg_http_message *hm) {
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  char headers[128];
+  if (not_modified(c, hm, &state, CONTENT_TYPE_JSON, headers, sizeof(headers)))
+    return;
+
+  mg_http_reply(c, 200, headers, "%M", render_json_state, &state);
+}
+
+static void handle_v1_get_capabilities(struct mg_connection *c,
+                                       struct mg_http_message *hm) {
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  mg_http_reply(c, 200, CONTENT_TYPE_JSON, "%M", render_json_capabilities,
+                &state);
+}
+
+static void handle_v1_get_stats(struct mg_connection *c,
+                                struct mg_http_message *hm) {
+  mg_http_reply(c, 200, CONTENT_TYPE_JSON, "%M", render_json_stats);
+}
+
+// any subset of the settings in one request, applied all or nothing; fields
+// that are not present keep their value, anything else is rejected
+static void handle_v1_post_settings(struct mg_connection *c,
+                                    struct mg_http_message *hm) {
+  struct camera_settings_t settings;
+  char error_str[64];
+
+  const char *parse_error =
+      parse_settings_json(hm->body, &settings, error_str, sizeof(error_str));
+  if (parse_error != NULL) {
+    render_json_error(c, 400, parse_error);
+    return;
+  }
+
+  if (!(settings.fields & SETTINGS_PROPERTIES)) {
+    const char *error = apply_settings(&settings);
+    if (error != NULL)
+      render_json_error(c, 400, error);
+    else
+      render_json_result_response(c, EDS_ERR_OK);
+    return;
+  }
+
+  // the camera writes go out as one command, the response waits for them
+  connection_data(c)->deferred = DEFERRED_JSON_STATE;
+
+  bool posted = false;
+  const char *error = apply_property_settings(
+      &settings, wakeup_connection, (void *)(uintptr_t)c->id, &posted);
+  if (posted)
+    return;
+
+  connection_data(c)->deferred = DEFERRED_NONE;
+
+  if (error != NULL)
+    render_json_error(c, 400, error);
+  else
+    render_json_saved_response(c);
+}
+
+static void handle_v1_initialize(struct mg_connection *c,
+                                 struct mg_http_message *hm) {
+  post_deferred(c, INITIALIZE, DEFERRED_JSON_STATE);
+}
+
+static void handle_v1_connect(struct mg_connection *c,
+                              struct mg_http_message *hm) {
+  post_deferred(c, CONNECT, DEFERRED_JSON_STATE);
+}
+
+static void handle_v1_disconnect(struct mg_connection *c,
+                                 struct mg_http_message *hm) {
+  post_deferred(c, DISCONNECT, DEFERRED_JSON_STATE);
+}
+
+static void handle_v1_start_shoot(struct mg_connection *c,
+                                  struct mg_http_message *hm) {
+  post_deferred(c, START_SHOOTING, DEFERRED_JSON_STATE);
+}
+
+static void handle_v1_stop_shoot(struct mg_connection *c,
+                                 struct mg_http_message *hm) {
+  post_deferred(c, STOP_SHOOTING, DEFERRED_JSON_STATE);
+}
+
+static void handle_v1_take_picture(struct mg_connection *c,
+                                   struct mg_http_message *hm) {
+  post_deferred(c, TAKE_PICTURE, DEFERRED_JSON_STATE);
 }
 
 static struct mg_http_serve_opts g_serve_opts = {0};
 
+#define ASSET_CACHE_CONTROL                                                    \
+  "Cache-Control: public, max-age=31536000, immutable\r\n"                    \
+  "Vary: Accept-Encoding\r\n"
+
+// q-values are ignored, clients only list gzip when they can decode it
+static struct mg_str str_trim(struct mg_str s) {
+  while (s.len > 0 && (s.buf[0] == ' ' || s.buf[0] == '\t'))
+    s = mg_str_n(s.buf + 1, s.len - 1);
+  while (s.len > 0 && (s.buf[s.len - 1] == ' ' || s.buf[s.len - 1] == '\t'))
+    s.len--;
+
+  return s;
+}
+
+// q values have at most three decimals, a zero one is only made of '0' and
+// '.'; "gzip;q=0" refuses gzip
+static bool quality_is_zero(struct mg_str params) {
+  struct mg_str param;
+  while (mg_span(params, &param, &params, ';')) {
+    param = str_trim(param);
+    if (param.len < 3 || (param.buf[0] != 'q' && param.buf[0] != 'Q') ||
+        param.buf[1] != '=')
+      continue;
+
+    for (size_t i = 2; i < param.len; i++) {
+      if (param.buf[i] != '0' && param.buf[i] != '.')
+        return false;
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+static bool accepts_gzip(struct mg_http_message *hm) {
+  struct mg_str *accept_encoding = mg_http_get_header(hm, "Accept-Encoding");
+  if (accept_encoding == NULL)
+    return false;
+
+  struct mg_str codings = *accept_encoding, coding;
+  while (mg_span(codings, &coding, &codings, ',')) {
+    struct mg_str name, params;
+    mg_span(coding, &name, &params, ';');
+    if (mg_strcasecmp(str_trim(name), mg_str("gzip")) == 0)
+      return !quality_is_zero(params);
+  }
+
+  return false;
+}
+
 static void handle_get_assets(struct mg_connection *c,
                               struct mg_http_message *hm) {
-  mg_http_serve_dir(c, hm, &g_serve_opts);
+  const struct asset_t *asset = asset_find(hm->uri);
+
+  if (asset == NULL) {
+    // files added to the web root without a rebuild
+    mg_http_serve_dir(c, hm, &g_serve_opts);
+    return;
+  }
+
+  bool gzip = accepts_gzip(hm);
+
+  // each encoding is a different representation with its own strong tag
+  char etag[ETAG_SIZE];
+  mg_snprintf(etag, sizeof(etag), "\"%s%s\"", asset->hash,
+              gzip ? "-gzip" : "");
+
+  if (etag_matches(hm, etag)) {
+    mg_printf(c,
+              "HTTP/1.1 304 Not Modified\r\n" ASSET_CACHE_CONTROL
+              "ETag: %s\r\nContent-Length: 0\r\n\r\n",
+              etag);
+    return;
+  }
+
+  const unsigned char *data = gzip ? asset->gzip_data : asset->data;
+  size_t size = gzip ? asset->gzip_size : asset->size;
+
+  mg_printf(c,
+            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s" ASSET_CACHE_CONTROL
+            "ETag: %s\r\nContent-Length: %lu\r\n\r\n",
+            asset->mime_type, gzip ? "Content-Encoding: gzip\r\n" : "", etag,
+            (unsigned long)size);
+  mg_send(c, data, size);
 }
 
 static struct http_handler_t http_handlers[] = {
     {
-        .endpoint = "POST /api/camera/state/delay",
+        .method = "POST",
+        .path = "/api/camera/state/delay",
+        .match = ROUTE_EXACT,
         .handler = handle_input_delay,
     },
     {
-        .endpoint = "POST /api/camera/state/iso",
+        .method = "POST",
+        .path = "/api/camera/state/iso",
+        .match = ROUTE_EXACT,
         .handler = handle_input_iso,
     },
     {
-        .endpoint = "POST /api/camera/state/exposure",
+        .method = "POST",
+        .path = "/api/camera/state/exposure",
+        .match = ROUTE_EXACT,
         .handler = handle_input_exposure,
     },
     {
-        .endpoint = "POST /api/camera/state/interval",
+        .method = "POST",
+        .path = "/api/camera/state/interval",
+        .match = ROUTE_EXACT,
         .handler = handle_input_interval,
     },
     {
-        .endpoint = "POST /api/camera/state/frames",
+        .method = "POST",
+        .path = "/api/camera/state/frames",
+        .match = ROUTE_EXACT,
         .handler = handle_input_frames,
     },
     {
-        .endpoint = "GET /api/camera/state",
+        .method = "GET",
+        .path = "/api/camera/state",
+        .match = ROUTE_EXACT,
         .handler = handle_get_state,
     },
     {
-        .endpoint = "GET /api/camera",
+        .method = "GET",
+        .path = "/api/camera/events",
+        .match = ROUTE_EXACT,
+        .handler = handle_get_events,
+    },
+    {
+        .method = "GET",
+        .path = "/api/camera",
+        .match = ROUTE_EXACT,
         .handler = handle_get_camera,
     },
     {
-        .endpoint = "POST /api/camera/connect",
+        .method = "POST",
+        .path = "/api/camera/connect",
+        .match = ROUTE_EXACT,
         .handler = handle_camera_connect,
     },
     {
-        .endpoint = "POST /api/camera/disconnect",
+        .method = "POST",
+        .path = "/api/camera/disconnect",
+        .match = ROUTE_EXACT,
         .handler = handle_camera_disconnect,
     },
     {
-        .endpoint = "POST /api/camera/start-shoot",
+        .method = "POST",
+        .path = "/api/camera/start-shoot",
+        .match = ROUTE_EXACT,
         .handler = handle_camera_start_shoot,
     },
     {
-        .endpoint = "POST /api/camera/stop-shoot",
+        .method = "POST",
+        .path = "/api/camera/stop-shoot",
+        .match = ROUTE_EXACT,
         .handler = handle_camera_stop_shoot,
     },
     {
-        .endpoint = "POST /api/camera/take-picture",
+        .method = "POST",
+        .path = "/api/camera/take-picture",
+        .match = ROUTE_EXACT,
         .handler = handle_camera_take_picture,
     },
     {
-        .endpoint = "GET /assets/*",
+        .method = "GET",
+        .path = "/api/v1/state",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_get_state,
+    },
+    {
+        .method = "GET",
+        .path = "/api/v1/capabilities",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_get_capabilities,
+    },
+    {
+        .method = "GET",
+        .path = "/api/v1/stats",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_get_stats,
+    },
+    {
+        .method = "POST",
+        .path = "/api/v1/settings",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_post_settings,
+    },
+    {
+        .method = "POST",
+        .path = "/api/v1/initialize",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_initialize,
+    },
+    {
+        .method = "POST",
+        .path = "/api/v1/connect",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_connect,
+    },
+    {
+        .method = "POST",
+        .path = "/api/v1/disconnect",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_disconnect,
+    },
+    {
+        .method = "POST",
+        .path = "/api/v1/start-shoot",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_start_shoot,
+    },
+    {
+        .method = "POST",
+        .path = "/api/v1/stop-shoot",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_stop_shoot,
+    },
+    {
+        .method = "POST",
+        .path = "/api/v1/take-picture",
+        .match = ROUTE_EXACT,
+        .handler = handle_v1_take_picture,
+    },
+    {
+        .method = "GET",
+        .path = "/assets/",
+        .match = ROUTE_PREFIX,
         .handler = handle_get_assets,
     },
     {
-        .endpoint = "GET /",
+        .method = "GET",
+        .path = "/",
+        .match = ROUTE_EXACT,
         .handler = render_index_html_response,
     },
 };
-static int32_t http_handlers_len =
-    sizeof(http_handlers) / sizeof(struct http_handler_t);
+
+// exact routes live in an open addressing table built once at startup, so
+// dispatch costs one hash of the request line whatever the number of routes
+// sized from the handlers: the power of two holding at least twice them,
+// so probes stay short and always reach an empty slot
+#define ROUTE_SLOTS_MIN (2 * ARRAY_SIZE(http_handlers))
+#define ROUTE_SLOTS                                                            \
+  (ROUTE_SLOTS_MIN <= 32    ? 32                                               \
+   : ROUTE_SLOTS_MIN <= 64  ? 64                                               \
+   : ROUTE_SLOTS_MIN <= 128 ? 128                                              \
+                            : 256)
+#define ROUTE_PREFIXES 4
+
+_Static_assert(ROUTE_SLOTS >= ROUTE_SLOTS_MIN,
+               "too many routes, extend ROUTE_SLOTS");
+
+static const struct http_handler_t *g_routes[ROUTE_SLOTS];
+static const struct http_handler_t *g_prefix_routes[ROUTE_PREFIXES];
+static int32_t g_prefix_routes_len = 0;
+
+// FNV-1a over "METHOD path"
+static uint32_t route_hash(struct mg_str method, struct mg_str path) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < method.len; i++)
+    hash = (hash ^ (uint8_t)method.buf[i]) * 16777619u;
+
+  hash = (hash ^ ' ') * 16777619u;
+
+  for (size_t i = 0; i < path.len; i++)
+    hash = (hash ^ (uint8_t)path.buf[i]) * 16777619u;
+
+  return hash;
+}
+
+static bool route_has_prefix(struct mg_str path, const char *prefix) {
+  size_t len = strlen(prefix);
+  return path.len >= len && memcmp(path.buf, prefix, len) == 0;
+}
+
+static void routes_init(void) {
+  for (size_t i = 0; i < ARRAY_SIZE(http_handlers); i++) {
+    const struct http_handler_t *route = &http_handlers[i];
+
+    if (route->match == ROUTE_PREFIX) {
+      assert(g_prefix_routes_len < ROUTE_PREFIXES);
+      g_prefix_routes[g_prefix_routes_len++] = route;
+      continue;
+    }
+
+    uint32_t slot =
+        route_hash(mg_str(route->method), mg_str(route->path)) &
+        (ROUTE_SLOTS - 1);
+    while (g_routes[slot] != NULL)
+      slot = (slot + 1) & (ROUTE_SLOTS - 1);
+
+    g_routes[slot] = route;
+  }
+}
+
+static const struct http_handler_t *route_lookup(struct mg_str method,
+                                                 struct mg_str path) {
+  uint32_t slot = route_hash(method, path) & (ROUTE_SLOTS - 1);
+
+  for (; g_routes[slot] != NULL; slot = (slot + 1) & (ROUTE_SLOTS - 1)) {
+    const struct http_handler_t *route = g_routes[slot];
+    if (mg_strcmp(method, mg_str(route->method)) == 0 &&
+        mg_strcmp(path, mg_str(route->path)) == 0)
+      return route;
+  }
+
+  for (int32_t i = 0; i < g_prefix_routes_len; i++) {
+    const struct http_handler_t *route = g_prefix_routes[i];
+    if (mg_strcmp(method, mg_str(route->method)) == 0 &&
+        route_has_prefix(path, route->path))
+      return route;
+  }
+
+  return NULL;
+}
 
 static void evt_handler(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = (struct mg_http_message *)ev_data;
 
-    struct mg_str method_uri =
-        mg_str_n(hm->method.buf, hm->method.len + hm->uri.len + 1);
+    const struct http_handler_t *route = route_lookup(hm->method, hm->uri);
 
-    for (int32_t i = 0; i < http_handlers_len; i++) {
-      if (mg_match(method_uri, mg_str(http_handlers[i].endpoint), NULL)) {
-        http_handlers[i].handler(c, hm);
-        return;
-      }
+    if (route != NULL) {
+      route->handler(c, hm);
+      // setters change the state on this thread, the command thread never
+      // reports those; a no-op when the version didn't move
+      publish_state();
+      return;
     }
 
     not_found(c);
+  } else if (ev == MG_EV_WAKEUP) {
+    if (c->is_listening)
+      publish_state();
+    else
+      render_deferred_response(c, (struct mg_str *)ev_data);
   }
 }
 
 void *http_server_thread(void *web_root) {
   g_serve_opts.root_dir = web_root;
+  mg_random(&g_etag_epoch, sizeof(g_etag_epoch));
+  routes_init();
 
-  struct mg_mgr mgr;
   mg_log_set(MG_LL_DEBUG);
-  mg_mgr_init(&mgr);
-  mg_http_listen(&mgr, s_http_addr, evt_handler, NULL);
+  mg_mgr_init(&g_mgr);
+  mg_wakeup_init(&g_mgr);
+  struct mg_connection *listener =
+      mg_http_listen(&g_mgr, s_http_addr, evt_handler, NULL);
+
+  if (listener != NULL) {
+    get_state_copy(&g_published_state);
+    atomic_store(&g_listener_id, listener->id);
+    set_state_listener(wakeup_listener);
+  }
   while (is_running()) {
-    mg_mgr_poll(&mgr, 1000);
+    mg_mgr_poll(&g_mgr, 1000);
   }
-  mg_mgr_free(&mgr);
+  set_state_listener(NULL);
+  mg_mgr_free(&g_mgr);
+
+  fragment_cache_free(&g_exposure_cache);
+  fragment_cache_free(&g_iso_cache);
+  fragment_cache_free(&g_content_cache);
 
   return NULL;
 }
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,6 +6,7 @@
 
 #include "camera.h"
 #include "http.h"
+#include "realtime.h"
 
 static pthread_t http_server;
 static pthread_t main_thread;
@@ -15,19 +17,51 @@ void print_help(char *cmdline) {
   printf("Canon Intervalometer for Raspberry PI\n");
   printf("\n");
   printf("Options:\n");
-  printf("  -w, --web-root <path> Web root folder\n");
-  printf("  -h, --help            Dislay help\n");
+  printf("  -w, --web-root <path>   Web root folder\n");
+  printf("  -g, --timer-guard <us>  Busy-wait before timers, default 2000\n");
+  printf("  -m, --timer-mode <mode> sleep, spin or yield, default yield\n");
+  printf("  -e, --event-pump <ms>   Camera event polling period, default 20\n");
+  printf("  -r, --realtime <cpu>    Run the camera thread SCHED_FIFO, alone "
+         "on cpu\n");
+  printf("  -h, --help              Dislay help\n");
 }
 
 static char web_root[PATH_MAX] = {0};
 
+// the whole argument must be a decimal number within [min, max]
+static bool parse_option(const char *str, int64_t min, int64_t max,
+                         int64_t *value) {
+  char *end = NULL;
+  errno = 0;
+  long long number = strtoll(str, &end, 10);
+
+  if (end == str || *end != '\0' || errno == ERANGE)
+    return false;
+
+  if (number < min || number > max)
+    return false;
+
+  *value = number;
+  return true;
+}
+
 int main(int argc, char *argv[]) {
-  const char *short_options = "h::w::";
+  const char *short_options = "h::w::g:m:e:r:";
   const struct option long_options[] = {
       {"help", no_argument, NULL, 'h'},
       {"web-root", required_argument, NULL, 'w'},
+      {"timer-guard", required_argument, NULL, 'g'},
+      {"timer-mode", required_argument, NULL, 'm'},
+      {"event-pump", required_argument, NULL, 'e'},
+      {"realtime", required_argument, NULL, 'r'},
+      {0, 0, 0, 0},
   };
+  int64_t timer_guard_ns = TIMER_GUARD_NS;
+  enum wait_mode timer_mode = WAIT_YIELD;
+  int64_t event_pump_ns = EVENT_PUMP_NS;
+  int32_t reserved_cpu = -1;
 
+  int64_t value;
   int next_option;
   do {
     next_option = getopt_long(argc, argv, short_options, long_options, NULL);
@@ -37,6 +71,45 @@ int main(int argc, char *argv[]) {
       strncpy(web_root, optarg, PATH_MAX);
       break;
 
+    case 'g':
+      // up to a second
+      if (!parse_option(optarg, 0, SEC_TO_NS / MICRO_TO_NS, &value)) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      timer_guard_ns = value * MICRO_TO_NS;
+      break;
+
+    case 'm':
+      if (strcmp(optarg, "sleep") == 0) {
+        timer_mode = WAIT_SLEEP;
+      } else if (strcmp(optarg, "spin") == 0) {
+        timer_mode = WAIT_SPIN;
+      } else if (strcmp(optarg, "yield") == 0) {
+        timer_mode = WAIT_YIELD;
+      } else {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'e':
+      // up to a minute
+      if (!parse_option(optarg, 1, 60 * SEC_TO_NS / MILLI_TO_NS, &value)) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      event_pump_ns = value * MILLI_TO_NS;
+      break;
+
+    case 'r':
+      if (!parse_option(optarg, 0, INT32_MAX, &value)) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      reserved_cpu = (int32_t)value;
+      break;
+
     case '?':
     case 'h':
       print_help(argv[0]);
@@ -51,8 +124,19 @@ int main(int argc, char *argv[]) {
 
   main_thread = pthread_self();
 
+  camera_init();
+  set_timer_precision(timer_guard_ns, timer_mode);
+  set_event_pump_period(event_pump_ns);
+
+  // the http thread inherits the affinity, it stays off the reserved cpu
+  if (reserved_cpu >= 0)
+    realtime_reserve_cpu(reserved_cpu);
+
   pthread_create(&http_server, NULL, http_server_thread, web_root);
 
+  if (reserved_cpu >= 0)
+    realtime_enter(reserved_cpu, REALTIME_PRIORITY);
+
   // EDSDK demands its api call to be in the main thread on MacOS
   command_processor();
 
@@ -2,93 +2,356 @@
 #include "timer.h"
 
 #include <assert.h>
-#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
 
-int32_t queue_enqueue(struct queue_t *b, int32_t cmd, void *data) {
-  assert(pthread_mutex_lock(&b->mutex) == 0);
+// producers spin this many times on a full ring before backing off
+#define FULL_SPINS 64
+#define FULL_BACKOFF_NS (1 * MILLI_TO_NS)
+// the consumer yields this many times on an empty ring before sleeping
+#define IDLE_SPINS 16
 
-  while (b->size >= BUFFER_SIZE)
-    assert(pthread_cond_wait(&b->consumed, &b->mutex) == 0);
+bool queue_init(struct queue_t *b, queue_lane_fn lane_of) {
+  for (int32_t lane = 0; lane < QUEUE_LANES; lane++) {
+    struct queue_ring_t *ring = &b->lanes[lane];
 
-  assert(b->size < BUFFER_SIZE);
+    for (uint32_t i = 0; i < BUFFER_SIZE; i++)
+      atomic_init(&ring->cells[i].sequence, i);
 
-  int nextin = b->nextin++;
-  b->nextin %= BUFFER_SIZE;
-  b->size++;
+    atomic_init(&ring->nextin, 0);
+    atomic_init(&ring->nextout, 0);
+    atomic_init(&ring->max_depth, 0);
+    atomic_init(&ring->dispatched, 0);
+    atomic_init(&ring->total_wait_ns, 0);
+    atomic_init(&ring->max_wait_ns, 0);
+  }
+
+  b->lane_of = lane_of;
+  atomic_init(&b->sleeping, false);
+
+  return wakeup_init(&b->produced);
+}
+
+static enum queue_lane queue_lane_of(struct queue_t *b, int32_t cmd) {
+  return b->lane_of != NULL ? b->lane_of(cmd) : QUEUE_LANE_DATA;
+}
+
+// claims the next free cell of the ring, when it is full either waits for
+// the consumer or gives up and returns NULL
+static struct queue_cell_t *queue_ring_claim(struct queue_ring_t *ring,
+                                             uint32_t *pos, bool wait) {
+  *pos = atomic_load_explicit(&ring->nextin, memory_order_relaxed);
+  int32_t spins = 0;
+
+  for (;;) {
+    struct queue_cell_t *cell = &ring->cells[*pos % BUFFER_SIZE];
+    uint32_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    int32_t diff = (int32_t)(sequence - *pos);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->nextin, pos, *pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        return cell;
+    } else if (diff < 0) {
+      if (!wait)
+        return NULL;
+
+      // full, wait for the consumer to free the cell
+      if (++spins < FULL_SPINS)
+        sched_yield();
+      else
+        nssleep(FULL_BACKOFF_NS);
+
+      *pos = atomic_load_explicit(&ring->nextin, memory_order_relaxed);
+    } else {
+      *pos = atomic_load_explicit(&ring->nextin, memory_order_relaxed);
+    }
+  }
+}
+
+static int32_t queue_push(struct queue_t *b, int32_t cmd, void *data,
+                          struct completion_t *completion, bool wait) {
+  enum queue_lane lane = queue_lane_of(b, cmd);
+  struct queue_ring_t *ring = &b->lanes[lane];
+
+  uint32_t pos;
+  struct queue_cell_t *cell = queue_ring_claim(ring, &pos, wait);
+  if (cell == NULL)
+    return -1;
+
+  cell->cmd = cmd;
+  cell->data = data;
+  cell->completion = completion;
+  cell->enqueued_ns = get_monotonic_ns();
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+  // pairs with the fence in queue_dequeue so a sleeping consumer is never
+  // missed
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_exchange(&b->sleeping, false))
+    wakeup_signal(&b->produced);
 
-  b->buffer[nextin] = cmd;
-  b->buffer_data[nextin] = data;
+  return lane * BUFFER_SIZE + pos % BUFFER_SIZE;
+}
+
+int32_t queue_enqueue(struct queue_t *b, int32_t cmd, void *data,
+                      struct completion_t *completion) {
+  return queue_push(b, cmd, data, completion, /*wait*/ true);
+}
+
+int32_t queue_try_enqueue(struct queue_t *b, int32_t cmd, void *data,
+                          struct completion_t *completion) {
+  return queue_push(b, cmd, data, completion, /*wait*/ false);
+}
+
+static uint32_t queue_ring_depth(struct queue_ring_t *ring) {
+  return atomic_load_explicit(&ring->nextin, memory_order_relaxed) -
+         atomic_load_explicit(&ring->nextout, memory_order_relaxed);
+}
+
+static void queue_ring_account(struct queue_ring_t *ring, int64_t wait_ns) {
+  uint32_t depth = queue_ring_depth(ring);
+
+  if (depth > atomic_load_explicit(&ring->max_depth, memory_order_relaxed))
+    atomic_store_explicit(&ring->max_depth, depth, memory_order_relaxed);
 
-  assert(pthread_cond_signal(&b->produced) == 0);
-  assert(pthread_mutex_unlock(&b->mutex) == 0);
+  if (wait_ns > atomic_load_explicit(&ring->max_wait_ns, memory_order_relaxed))
+    atomic_store_explicit(&ring->max_wait_ns, wait_ns, memory_order_relaxed);
 
-  return nextin;
+  atomic_fetch_add_explicit(&ring->total_wait_ns, wait_ns,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&ring->dispatched, 1, memory_order_relaxed);
 }
 
-static void adjust_timer_ns(struct timespec *ts, int64_t timer_ns) {
-  clock_gettime(CLOCK_REALTIME, ts);
+// returns the slot, lanes are tried in priority order
+static int32_t queue_try_dequeue(struct queue_t *b, int32_t *cmd, void **data,
+                                 struct completion_t **completion) {
+  for (int32_t lane = 0; lane < QUEUE_LANES; lane++) {
+    struct queue_ring_t *ring = &b->lanes[lane];
+    uint32_t nextout =
+        atomic_load_explicit(&ring->nextout, memory_order_relaxed);
+    struct queue_cell_t *cell = &ring->cells[nextout % BUFFER_SIZE];
+    uint32_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
 
-  ts->tv_sec += timer_ns / SEC_TO_NS;
-  ts->tv_nsec += timer_ns % SEC_TO_NS;
+    if ((int32_t)(sequence - (nextout + 1)) < 0)
+      continue;
 
-  ts->tv_sec += ts->tv_nsec / SEC_TO_NS;
-  ts->tv_nsec = ts->tv_nsec % SEC_TO_NS;
+    *cmd = cell->cmd;
+    *data = cell->data;
+    *completion = cell->completion;
+
+    // depth includes the command being dequeued
+    queue_ring_account(ring, get_monotonic_ns() - cell->enqueued_ns);
+
+    atomic_store_explicit(&cell->sequence, nextout + BUFFER_SIZE,
+                          memory_order_release);
+    atomic_store_explicit(&ring->nextout, nextout + 1, memory_order_relaxed);
+
+    return lane * BUFFER_SIZE + nextout % BUFFER_SIZE;
+  }
+
+  return -1;
 }
 
 int32_t queue_dequeue(struct queue_t *b, int32_t *cmd, void **data,
-                      int64_t timer_ns) {
-  assert(pthread_mutex_lock(&b->mutex) == 0);
+                      struct completion_t **completion, int64_t timer_ns) {
+  int64_t deadline_ns = get_monotonic_ns() + timer_ns;
+
+  int32_t slot = queue_try_dequeue(b, cmd, data, completion);
+
+  for (int32_t i = 0; slot < 0 && i < IDLE_SPINS; i++) {
+    sched_yield();
+    slot = queue_try_dequeue(b, cmd, data, completion);
+  }
+
+  // returns -1 on timeout or when interrupted with an empty queue
+  if (slot < 0) {
+    atomic_store(&b->sleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
 
-  struct timespec ts = {0, 0};
-  adjust_timer_ns(&ts, timer_ns);
+    slot = queue_try_dequeue(b, cmd, data, completion);
 
-  while (b->size <= 0) {
-    int ret = pthread_cond_timedwait(&b->produced, &b->mutex, &ts);
-    if (ret == ETIMEDOUT) {
-      assert(pthread_mutex_unlock(&b->mutex) == 0);
-      return -1;
+    if (slot < 0) {
+      wakeup_wait_until(&b->produced, deadline_ns);
+      slot = queue_try_dequeue(b, cmd, data, completion);
     }
+
+    atomic_store(&b->sleeping, false);
   }
 
-  assert(b->size > 0);
+  return slot;
+}
+
+void queue_get_stats(struct queue_t *b, enum queue_lane lane,
+                     struct queue_lane_stats_t *stats) {
+  struct queue_ring_t *ring = &b->lanes[lane];
+
+  // a snapshot, the depth may be off by one while producers are racing
+  stats->depth = queue_ring_depth(ring);
+  stats->max_depth = atomic_load(&ring->max_depth);
+  stats->dispatched = atomic_load(&ring->dispatched);
+  stats->total_wait_ns = atomic_load(&ring->total_wait_ns);
+  stats->max_wait_ns = atomic_load(&ring->max_wait_ns);
+}
+
+bool async_queue_init(struct sync_queue_t *queue, queue_lane_fn lane_of) {
+  return queue_init(&queue->queue, lane_of);
+}
+
+void async_queue_interrupt(struct sync_queue_t *queue) {
+  wakeup_signal(&queue->queue.produced);
+}
 
-  int nextout = b->nextout++;
-  b->nextout %= BUFFER_SIZE;
-  b->size--;
+static void completion_init_cond(pthread_cond_t *cond) {
+#ifdef __APPLE__
+  // no pthread_condattr_setclock, waits use the relative variant instead
+  assert(pthread_cond_init(cond, NULL) == 0);
+#else
+  pthread_condattr_t attr;
+  assert(pthread_condattr_init(&attr) == 0);
+  assert(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0);
+  assert(pthread_cond_init(cond, &attr) == 0);
+  assert(pthread_condattr_destroy(&attr) == 0);
+#endif
+}
 
-  *cmd = b->buffer[nextout];
-  *data = b->buffer_data[nextout];
+static struct completion_t *completion_create(int32_t refs) {
+  struct completion_t *completion = malloc(sizeof(struct completion_t));
+  assert(completion != NULL);
 
-  assert(pthread_cond_signal(&b->consumed) == 0);
-  assert(pthread_mutex_unlock(&b->mutex) == 0);
+  assert(pthread_mutex_init(&completion->mutex, NULL) == 0);
+  completion_init_cond(&completion->done_cond);
+  atomic_init(&completion->refs, refs);
+  completion->done = false;
+  completion->result = 0;
+  completion->notify = NULL;
+  completion->notify_data = NULL;
 
-  return nextout;
+  return completion;
 }
 
-void async_queue_unlock(struct sync_queue_t *queue, int32_t slot) {
-  assert(pthread_mutex_lock(&queue->sync_mutex) == 0);
-  queue->processed |= (1ul << slot);
-  assert(pthread_cond_signal(&queue->sync_wait) == 0);
-  assert(pthread_mutex_unlock(&queue->sync_mutex) == 0);
+void completion_release(struct completion_t *completion) {
+  if (atomic_fetch_sub(&completion->refs, 1) != 1)
+    return;
+
+  assert(pthread_cond_destroy(&completion->done_cond) == 0);
+  assert(pthread_mutex_destroy(&completion->mutex) == 0);
+  free(completion);
+}
+
+// timeout_ns < 0 waits forever, returns false on timeout
+bool completion_wait(struct completion_t *completion, int64_t timeout_ns,
+                     int32_t *result) {
+  int64_t deadline_ns = get_monotonic_ns() + timeout_ns;
+
+  assert(pthread_mutex_lock(&completion->mutex) == 0);
+
+  while (!completion->done) {
+    if (timeout_ns < 0) {
+      assert(pthread_cond_wait(&completion->done_cond, &completion->mutex) ==
+             0);
+      continue;
+    }
+
+    int64_t remaining_ns = deadline_ns - get_monotonic_ns();
+    if (remaining_ns <= 0)
+      break;
+
+#ifdef __APPLE__
+    struct timespec ts = {
+        .tv_sec = remaining_ns / SEC_TO_NS,
+        .tv_nsec = remaining_ns % SEC_TO_NS,
+    };
+    pthread_cond_timedwait_relative_np(&completion->done_cond,
+                                       &completion->mutex, &ts);
+#else
+    struct timespec ts = {
+        .tv_sec = deadline_ns / SEC_TO_NS,
+        .tv_nsec = deadline_ns % SEC_TO_NS,
+    };
+    pthread_cond_timedwait(&completion->done_cond, &completion->mutex, &ts);
+#endif
+  }
+
+  bool done = completion->done;
+  if (done && result != NULL)
+    *result = completion->result;
+
+  assert(pthread_mutex_unlock(&completion->mutex) == 0);
+
+  return done;
+}
+
+void async_queue_complete(struct completion_t *completion, int32_t result) {
+  if (completion == NULL)
+    return;
+
+  assert(pthread_mutex_lock(&completion->mutex) == 0);
+  completion->result = result;
+  completion->done = true;
+  assert(pthread_cond_broadcast(&completion->done_cond) == 0);
+  assert(pthread_mutex_unlock(&completion->mutex) == 0);
+
+  if (completion->notify != NULL)
+    completion->notify(result, completion->notify_data);
+
+  completion_release(completion);
 }
 
 int32_t async_queue_dequeue_locked(struct sync_queue_t *queue, int32_t *cmd,
-                                   void **data, int64_t timer_ns) {
-  return queue_dequeue(&queue->queue, cmd, data, timer_ns);
+                                   void **data,
+                                   struct completion_t **completion,
+                                   int64_t timer_ns) {
+  return queue_dequeue(&queue->queue, cmd, data, completion, timer_ns);
 }
 
-void async_queue_post(struct sync_queue_t *queue, int32_t cmd, void *data,
-                      bool async) {
-  assert(pthread_mutex_lock(&queue->sync_mutex) == 0);
+// the caller owns one reference and must completion_release() it
+struct completion_t *async_queue_submit(struct sync_queue_t *queue,
+                                        int32_t cmd, void *data) {
+  // one reference for the poster and one for the consumer
+  struct completion_t *completion = completion_create(2);
+  queue_enqueue(&queue->queue, cmd, data, completion);
+  return completion;
+}
+
+// never blocks, returns false when the lane is full; `notify` gets the
+// result on the consumer thread
+bool async_queue_post_notify(struct sync_queue_t *queue, int32_t cmd,
+                             void *data, completion_fn notify,
+                             void *notify_data) {
+  struct completion_t *completion = completion_create(1);
+  completion->notify = notify;
+  completion->notify_data = notify_data;
+
+  if (queue_try_enqueue(&queue->queue, cmd, data, completion) < 0) {
+    completion_release(completion);
+    return false;
+  }
 
-  int32_t slot = queue_enqueue(&queue->queue, cmd, data);
-  uint32_t mask = 1ul << slot;
+  return true;
+}
 
-  queue->processed &= ~mask;
+// fire and forget, never blocks; returns false when the lane is full
+bool async_queue_try_post(struct sync_queue_t *queue, int32_t cmd,
+                          void *data) {
+  return queue_try_enqueue(&queue->queue, cmd, data, NULL) >= 0;
+}
 
-  while (!async && (queue->processed & mask) == 0) {
-    assert(pthread_cond_wait(&queue->sync_wait, &queue->sync_mutex) == 0);
+int32_t async_queue_post(struct sync_queue_t *queue, int32_t cmd, void *data,
+                         bool async) {
+  if (async) {
+    queue_enqueue(&queue->queue, cmd, data, NULL);
+    return 0;
   }
 
-  assert(pthread_mutex_unlock(&queue->sync_mutex) == 0);
+  int32_t result = 0;
+
+  struct completion_t *completion = async_queue_submit(queue, cmd, data);
+  completion_wait(completion, WAIT_FOREVER, &result);
+  completion_release(completion);
+
+  return result;
 }
@@ -2,44 +2,117 @@
 #define QUEUE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "timer.h"
+
 #define BUFFER_SIZE 8
 
-struct queue_t {
-  int32_t buffer[BUFFER_SIZE];
-  void *buffer_data[BUFFER_SIZE];
-  int32_t size;
-  int32_t nextin;
-  int32_t nextout;
+typedef void (*completion_fn)(int32_t result, void *data);
+
+// future-like handle for one posted command, shared by the poster and the
+// consumer and freed when both released it; `notify` is called on the
+// consumer thread once the result is set
+struct completion_t {
   pthread_mutex_t mutex;
-  pthread_cond_t produced;
-  pthread_cond_t consumed;
+  pthread_cond_t done_cond;
+  _Atomic int32_t refs;
+  bool done;
+  int32_t result;
+  completion_fn notify;
+  void *notify_data;
+};
+
+// control commands are always dequeued before data commands
+enum queue_lane {
+  QUEUE_LANE_CONTROL,
+  QUEUE_LANE_DATA,
+  QUEUE_LANES,
+};
+
+typedef enum queue_lane (*queue_lane_fn)(int32_t cmd);
+
+struct queue_cell_t {
+  _Atomic uint32_t sequence;
+  int32_t cmd;
+  void *data;
+  struct completion_t *completion;
+  int64_t enqueued_ns;
+};
+
+// bounded lock-free multi-producer/single-consumer ring
+struct queue_ring_t {
+  struct queue_cell_t cells[BUFFER_SIZE];
+  _Atomic uint32_t nextin;
+  // written by the consumer only, readable from any thread
+  _Atomic uint32_t nextout;
+  _Atomic uint32_t max_depth;
+  _Atomic uint64_t dispatched;
+  _Atomic int64_t total_wait_ns;
+  _Atomic int64_t max_wait_ns;
+};
+
+struct queue_lane_stats_t {
+  uint32_t depth;
+  uint32_t max_depth;
+  uint64_t dispatched;
+  int64_t total_wait_ns;
+  int64_t max_wait_ns;
+};
+
+// one ring per lane, the consumer sleeps on `produced` and is only signaled
+// when it is actually waiting
+struct queue_t {
+  struct queue_ring_t lanes[QUEUE_LANES];
+  queue_lane_fn lane_of;
+  atomic_bool sleeping;
+  struct wakeup_t produced;
 };
 
 #define QUEUE_INITIALIZER                                                      \
   {                                                                            \
-    .buffer = {0}, .buffer_data = {0}, .size = 0, .nextin = 0, .nextout = 0,   \
-    .mutex = PTHREAD_MUTEX_INITIALIZER, .produced = PTHREAD_COND_INITIALIZER,  \
-    .consumed = PTHREAD_COND_INITIALIZER                                       \
+    .lanes = {{.nextin = 0}}, .lane_of = NULL, .sleeping = false,              \
+    .produced = WAKEUP_INITIALIZER                                             \
   }
 
-int32_t queue_enqueue(struct queue_t *b, int32_t cmd, void *data);
+bool queue_init(struct queue_t *b, queue_lane_fn lane_of);
+void queue_get_stats(struct queue_t *b, enum queue_lane lane,
+                     struct queue_lane_stats_t *stats);
+int32_t queue_enqueue(struct queue_t *b, int32_t cmd, void *data,
+                      struct completion_t *completion);
+// -1 instead of waiting when the lane is full
+int32_t queue_try_enqueue(struct queue_t *b, int32_t cmd, void *data,
+                          struct completion_t *completion);
 int32_t queue_dequeue(struct queue_t *b, int32_t *cmd, void **data,
-                      int64_t timer_ns);
+                      struct completion_t **completion, int64_t timer_ns);
+
+#define WAIT_FOREVER -1
+
+bool completion_wait(struct completion_t *completion, int64_t timeout_ns,
+                     int32_t *result);
+void completion_release(struct completion_t *completion);
 
 struct sync_queue_t {
   struct queue_t queue;
-  pthread_mutex_t sync_mutex;
-  pthread_cond_t sync_wait;
-  uint32_t processed;
 };
 
-void async_queue_unlock(struct sync_queue_t *queue, int32_t slot);
+bool async_queue_init(struct sync_queue_t *queue, queue_lane_fn lane_of);
+void async_queue_interrupt(struct sync_queue_t *queue);
+void async_queue_complete(struct completion_t *completion, int32_t result);
 int32_t async_queue_dequeue_locked(struct sync_queue_t *queue, int32_t *cmd,
-                                   void **data, int64_t timer_ns);
-void async_queue_post(struct sync_queue_t *queue, int32_t cmd, void *data,
-                      bool async);
+                                   void **data,
+                                   struct completion_t **completion,
+                                   int64_t timer_ns);
+struct completion_t *async_queue_submit(struct sync_queue_t *queue,
+                                        int32_t cmd, void *data);
+bool async_queue_post_notify(struct sync_queue_t *queue, int32_t cmd,
+                             void *data, completion_fn notify,
+                             void *notify_data);
+bool async_queue_try_post(struct sync_queue_t *queue, int32_t cmd,
+                          void *data);
+int32_t async_queue_post(struct sync_queue_t *queue, int32_t cmd, void *data,
+                         bool async);
 
 #endif // QUEUE_H
@@ -0,0 +1,115 @@
+#ifdef __linux__
+#define _GNU_SOURCE // cpu affinity
+#endif
+
+#include "realtime.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mongoose.h"
+
+// stack touched up front so the locked pages are already mapped
+#define PREFAULT_STACK_SIZE (256 * 1024)
+#define PAGE_SIZE_MIN 4096
+
+static int32_t g_realtime_cpu = -1;
+
+static bool valid_cpu(int32_t cpu) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpu < 0 || cpu >= cpus) {
+    MG_ERROR(("Invalid cpu %d, %ld online", cpu, cpus));
+    return false;
+  }
+
+  return true;
+}
+
+bool realtime_reserve_cpu(int32_t cpu) {
+  if (!valid_cpu(cpu))
+    return false;
+
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int32_t i = 0; i < cpus; i++) {
+    if (i != cpu)
+      CPU_SET(i, &set);
+  }
+
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0) {
+    MG_ERROR(("Failed to keep threads off cpu %d: %s", cpu, strerror(ret)));
+    return false;
+  }
+
+  return true;
+#else
+  MG_ERROR(("Cpu affinity not supported on this platform"));
+  return false;
+#endif
+}
+
+static void prefault_stack(void) {
+  volatile uint8_t stack[PREFAULT_STACK_SIZE];
+
+  for (size_t i = 0; i < sizeof(stack); i += PAGE_SIZE_MIN)
+    stack[i] = 0;
+}
+
+bool realtime_enter(int32_t cpu, int32_t priority) {
+  if (!valid_cpu(cpu))
+    return false;
+
+  bool ok = true;
+  bool pinned = false;
+  int ret;
+
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0) {
+    MG_ERROR(("Failed to pin to cpu %d: %s", cpu, strerror(ret)));
+    ok = false;
+  } else {
+    pinned = true;
+  }
+#else
+  MG_ERROR(("Cpu affinity not supported on this platform"));
+  ok = false;
+#endif
+
+  struct sched_param param = {.sched_priority = priority};
+  ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (ret != 0) {
+    MG_ERROR(("Failed to set SCHED_FIFO %d: %s", priority, strerror(ret)));
+    ok = false;
+  }
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    MG_ERROR(("Failed to lock memory: %s", strerror(errno)));
+    ok = false;
+  }
+
+  prefault_stack();
+
+  // only reported once the thread actually runs there
+  if (pinned)
+    g_realtime_cpu = cpu;
+
+  MG_INFO(("Real-time mode on cpu %d, priority %d%s", cpu, priority,
+           ok ? "" : " (partially applied)"));
+
+  return ok;
+}
+
+int32_t realtime_cpu(void) { return g_realtime_cpu; }
@@ -0,0 +1,22 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define REALTIME_PRIORITY 80
+
+// keeps the calling thread, and the threads it creates afterwards, off
+// `cpu`; call before starting the other threads
+bool realtime_reserve_cpu(int32_t cpu);
+
+// pins the calling thread to `cpu`, raises it to SCHED_FIFO at `priority`
+// and locks the process memory; steps that succeed stay applied when a
+// later one fails, usually for lack of CAP_SYS_NICE/CAP_IPC_LOCK
+bool realtime_enter(int32_t cpu, int32_t priority);
+
+// cpu the real-time thread is pinned to, -1 when the mode is off or the
+// pinning failed
+int32_t realtime_cpu(void);
+
+#endif // REALTIME_H
@@ -0,0 +1,162 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#include "mongoose.h"
+#include "settings.h"
+#include "timer.h"
+
+bool parse_seconds(const char *value_str, int64_t *value_ns) {
+  double seconds = 0;
+  if (sscanf(value_str, "%lf", &seconds) != 1)
+    return false;
+
+  if (!(seconds >= 0 && seconds <= (double)(INT64_MAX / SEC_TO_NS)))
+    return false;
+
+  *value_ns = (int64_t)(seconds * 1000 + 0.5) * MILLI_TO_NS;
+  return true;
+}
+
+const char *validate_settings(const struct camera_settings_t *settings,
+                              const struct settings_limits_t *limits) {
+  if ((settings->fields & SETTING_DELAY) && settings->delay_ns < 0)
+    return "delay_ns must not be negative";
+
+  if ((settings->fields & SETTING_INTERVAL) && settings->interval_ns < 0)
+    return "interval_ns must not be negative";
+
+  if ((settings->fields & SETTING_INTERVAL) &&
+      settings->interval_ns < limits->trigger_latency_ns)
+    return "interval_ns shorter than the trigger latency";
+
+  if ((settings->fields & SETTING_FRAMES) && settings->frames < 0)
+    return "frames must not be negative";
+
+  if ((settings->fields & SETTING_ISO_INDEX) &&
+      (settings->iso_index < 0 || settings->iso_index >= limits->iso_count))
+    return "iso_index out of range";
+
+  if ((settings->fields & SETTING_EXPOSURE_INDEX) &&
+      (settings->exposure_index < 0 ||
+       settings->exposure_index > limits->exposure_count))
+    return "exposure_index out of range";
+
+  if ((settings->fields & SETTING_EXPOSURE) && settings->exposure_ns <= 0)
+    return "exposure_ns must be positive";
+
+  return NULL;
+}
+
+struct settings_field_t {
+  const char *name;
+  enum camera_setting setting;
+  size_t offset;
+  bool wide; // int64_t, int32_t otherwise
+};
+
+#define SETTINGS_FIELD(name, setting, wide)                                    \
+  {#name, setting, offsetof(struct camera_settings_t, name), wide}
+
+static const struct settings_field_t settings_fields[] = {
+    SETTINGS_FIELD(delay_ns, SETTING_DELAY, true),
+    SETTINGS_FIELD(interval_ns, SETTING_INTERVAL, true),
+    SETTINGS_FIELD(frames, SETTING_FRAMES, false),
+    SETTINGS_FIELD(iso_index, SETTING_ISO_INDEX, false),
+    SETTINGS_FIELD(exposure_index, SETTING_EXPOSURE_INDEX, false),
+    SETTINGS_FIELD(exposure_ns, SETTING_EXPOSURE, true),
+};
+
+static const struct settings_field_t *find_settings_field(struct mg_str key) {
+  // keys come with their quotes
+  if (key.len < 2)
+    return NULL;
+
+  struct mg_str name = mg_str_n(key.buf + 1, key.len - 2);
+  size_t count = sizeof(settings_fields) / sizeof(settings_fields[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (mg_strcmp(name, mg_str(settings_fields[i].name)) == 0)
+      return &settings_fields[i];
+  }
+
+  return NULL;
+}
+
+// doubles hold integers exactly up to 2^53 ns, about 104 days
+static bool json_to_integer(struct mg_str token, bool wide, int64_t *value) {
+  double number = 0;
+  if (!mg_json_get_num(token, "$", &number))
+    return false;
+
+  double limit = wide ? 9007199254740992.0 : (double)INT32_MAX;
+  if (!(number >= -limit && number <= limit))
+    return false;
+
+  if (number != (double)(int64_t)number)
+    return false;
+
+  *value = (int64_t)number;
+  return true;
+}
+
+const char *parse_settings_json(struct mg_str json,
+                                struct camera_settings_t *settings,
+                                char *error_str, size_t size) {
+  struct mg_str body = mg_json_get_tok(json, "$");
+  if (body.buf == NULL || body.buf[0] != '{')
+    return "invalid json, expected an object";
+
+  *settings = (struct camera_settings_t){0};
+
+  struct mg_str key, value;
+  size_t ofs = 0;
+  while ((ofs = mg_json_next(body, ofs, &key, &value)) > 0) {
+    const struct settings_field_t *field = find_settings_field(key);
+    if (field == NULL) {
+      mg_snprintf(error_str, size, "unknown setting %.*s", (int)key.len,
+                  key.buf);
+      return error_str;
+    }
+
+    int64_t number = 0;
+    if (!json_to_integer(value, field->wide, &number)) {
+      mg_snprintf(error_str, size, "%s must be an integer in range",
+                  field->name);
+      return error_str;
+    }
+
+    uint8_t *target = (uint8_t *)settings + field->offset;
+    if (field->wide)
+      *(int64_t *)target = number;
+    else
+      *(int32_t *)target = (int32_t)number;
+
+    settings->fields |= field->setting;
+  }
+
+  return NULL;
+}
+
+void frame_plan_init(struct frame_plan_t *plan, int64_t start_ns,
+                     int32_t frames, int64_t interval_ns, int64_t exposure_ns,
+                     bool bulb) {
+  plan->start_ns = start_ns;
+  plan->frames = frames;
+  plan->exposure_ns = exposure_ns;
+  plan->bulb = bulb;
+  plan->period_ns = interval_ns;
+
+  // in bulb mode the interval is the gap between exposures
+  if (bulb)
+    plan->period_ns = add_ns(interval_ns, exposure_ns);
+}
+
+int64_t frame_plan_deadline_ns(const struct frame_plan_t *plan, int32_t frame) {
+  return add_ns(plan->start_ns, mul_ns(plan->period_ns, frame));
+}
+
+int64_t frame_plan_release_ns(const struct frame_plan_t *plan,
+                              int64_t exposure_start_ns,
+                              int64_t release_latency_ns) {
+  return add_ns(exposure_start_ns,
+                add_ns(plan->exposure_ns, -release_latency_ns));
+}
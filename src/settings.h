@@ -0,0 +1,75 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mongoose.h"
+
+// fields of camera_settings_t to apply
+enum camera_setting {
+  SETTING_DELAY = 1 << 0,
+  SETTING_INTERVAL = 1 << 1,
+  SETTING_FRAMES = 1 << 2,
+  SETTING_ISO_INDEX = 1 << 3,
+  SETTING_EXPOSURE_INDEX = 1 << 4,
+  SETTING_EXPOSURE = 1 << 5,
+};
+
+#define SETTINGS_PROPERTIES (SETTING_ISO_INDEX | SETTING_EXPOSURE_INDEX)
+
+struct camera_settings_t {
+  uint32_t fields; // camera_setting flags
+  int64_t delay_ns;
+  int64_t interval_ns;
+  int32_t frames;
+  int32_t iso_index;
+  int32_t exposure_index;
+  int64_t exposure_ns;
+};
+
+// what the connected camera allows
+struct settings_limits_t {
+  int32_t iso_count;
+  // one past the last exposure selects bulb
+  int32_t exposure_count;
+  // the camera can't be triggered faster than its shutter commands complete
+  int64_t trigger_latency_ns;
+};
+
+// seconds with up to millisecond resolution, "1.5" is 1500000000 ns
+bool parse_seconds(const char *value_str, int64_t *value_ns);
+
+// returns an error message, NULL when every field present is valid
+const char *validate_settings(const struct camera_settings_t *settings,
+                              const struct settings_limits_t *limits);
+
+// reads a json object holding any subset of the settings into `settings`;
+// returns an error message, kept in error_str when it names a field
+const char *parse_settings_json(struct mg_str json,
+                                struct camera_settings_t *settings,
+                                char *error_str, size_t size);
+
+// settings are copied into the plan when a sequence starts, so edits made
+// while shooting only apply to the next sequence
+struct frame_plan_t {
+  // frame N is triggered at start_ns + N * period_ns (CLOCK_MONOTONIC)
+  int64_t start_ns;
+  int64_t period_ns;
+  int64_t exposure_ns;
+  int32_t frames;
+  bool bulb;
+};
+
+void frame_plan_init(struct frame_plan_t *plan, int64_t start_ns,
+                     int32_t frames, int64_t interval_ns, int64_t exposure_ns,
+                     bool bulb);
+int64_t frame_plan_deadline_ns(const struct frame_plan_t *plan, int32_t frame);
+// the release of a bulb exposure is sent early by the time the camera takes
+// to close
+int64_t frame_plan_release_ns(const struct frame_plan_t *plan,
+                              int64_t exposure_start_ns,
+                              int64_t release_latency_ns);
+
+#endif // SETTINGS_H
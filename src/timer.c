@@ -1,44 +1,282 @@
+#ifdef __linux__
+#define _GNU_SOURCE // ppoll
+#endif
+
 #include "timer.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
-#define DELAYS_SIZE 32
+// samples accepted unconditionally while the estimate settles
+#define LATENCY_WARMUP 4
+// consecutive outliers taken as a real change of latency
+#define LATENCY_MAX_REJECTED 8
+// deviations below this are noise, keeps a very stable link from
+// rejecting everything
+#define LATENCY_MIN_DEVIATION_NS (2 * MILLI_TO_NS)
+
+static void timer_heap_swap(struct timer_heap_t *heap, int32_t i, int32_t j) {
+  struct timer_entry_t tmp = heap->entries[i];
+  heap->entries[i] = heap->entries[j];
+  heap->entries[j] = tmp;
+}
 
-static struct {
-  int32_t delays[DELAYS_SIZE];
-  int delays_start;
-  int delays_length;
-} g_timer = {
-    .delays = {0},
-    .delays_start = 0,
-    .delays_length = 0,
-};
+static void timer_heap_sift_down(struct timer_heap_t *heap, int32_t i) {
+  for (;;) {
+    int32_t left = 2 * i + 1;
+    int32_t right = left + 1;
+    int32_t smallest = i;
 
-void add_delay(int32_t delay) {
-  g_timer.delays[(g_timer.delays_start + g_timer.delays_length) % DELAYS_SIZE] =
-      delay;
+    if (left < heap->size && heap->entries[left].deadline_ns <
+                                 heap->entries[smallest].deadline_ns)
+      smallest = left;
+    if (right < heap->size && heap->entries[right].deadline_ns <
+                                  heap->entries[smallest].deadline_ns)
+      smallest = right;
+    if (smallest == i)
+      break;
 
-  if (g_timer.delays_length < DELAYS_SIZE) {
-    g_timer.delays_length++;
-  } else {
-    g_timer.delays_start = (g_timer.delays_start + 1) % DELAYS_SIZE;
+    timer_heap_swap(heap, i, smallest);
+    i = smallest;
   }
 }
 
-int32_t get_delay_average(void) {
-  if (g_timer.delays_length == 0)
-    return 0;
+bool timer_heap_push(struct timer_heap_t *heap, int64_t deadline_ns,
+                     int32_t cmd, void *data) {
+  if (heap->size >= TIMERS_SIZE)
+    return false;
 
-  int64_t sum = 0;
+  int32_t i = heap->size++;
+  heap->entries[i] = (struct timer_entry_t){
+      .deadline_ns = deadline_ns,
+      .cmd = cmd,
+      .data = data,
+  };
 
-  for (int i = 0; i < g_timer.delays_length; i++)
-    sum += g_timer.delays[(g_timer.delays_start + i) % DELAYS_SIZE];
+  while (i > 0) {
+    int32_t parent = (i - 1) / 2;
+    if (heap->entries[parent].deadline_ns <= heap->entries[i].deadline_ns)
+      break;
+    timer_heap_swap(heap, parent, i);
+    i = parent;
+  }
 
-  return sum / g_timer.delays_length;
+  return true;
+}
+
+bool timer_heap_peek(const struct timer_heap_t *heap, int64_t *deadline_ns,
+                     int32_t *cmd) {
+  if (heap->size == 0)
+    return false;
+
+  *deadline_ns = heap->entries[0].deadline_ns;
+  *cmd = heap->entries[0].cmd;
+  return true;
 }
 
-bool ussleep(int32_t timer_us) { return nssleep(timer_us * MICRO_TO_NS); }
+bool timer_heap_pop_expired(struct timer_heap_t *heap, int64_t now_ns,
+                            int32_t *cmd, void **data) {
+  if (heap->size == 0 || heap->entries[0].deadline_ns > now_ns)
+    return false;
+
+  *cmd = heap->entries[0].cmd;
+  *data = heap->entries[0].data;
+
+  heap->entries[0] = heap->entries[--heap->size];
+  timer_heap_sift_down(heap, 0);
+
+  return true;
+}
+
+bool timer_heap_find(const struct timer_heap_t *heap, int32_t cmd,
+                     int64_t *deadline_ns) {
+  bool found = false;
+
+  for (int32_t i = 0; i < heap->size; i++) {
+    if (heap->entries[i].cmd != cmd)
+      continue;
+
+    if (!found || heap->entries[i].deadline_ns < *deadline_ns)
+      *deadline_ns = heap->entries[i].deadline_ns;
+    found = true;
+  }
+
+  return found;
+}
+
+bool timer_heap_remove(struct timer_heap_t *heap, int32_t cmd) {
+  int32_t size = 0;
+
+  for (int32_t i = 0; i < heap->size; i++) {
+    if (heap->entries[i].cmd != cmd)
+      heap->entries[size++] = heap->entries[i];
+  }
+
+  if (size == heap->size)
+    return false;
+
+  heap->size = size;
+  for (int32_t i = heap->size / 2 - 1; i >= 0; i--)
+    timer_heap_sift_down(heap, i);
+
+  return true;
+}
+
+bool wakeup_init(struct wakeup_t *wakeup) {
+#ifdef __linux__
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  wakeup->read_fd = fd;
+  wakeup->write_fd = fd;
+#else
+  int fds[2];
+  if (pipe(fds) < 0)
+    return false;
+
+  for (int i = 0; i < 2; i++) {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  wakeup->read_fd = fds[0];
+  wakeup->write_fd = fds[1];
+#endif
+
+  return true;
+}
+
+void wakeup_signal(struct wakeup_t *wakeup) {
+  uint64_t value = 1;
+  // a full pipe or counter already means a pending wakeup
+  ssize_t ret = write(wakeup->write_fd, &value, sizeof(value));
+  (void)ret;
+}
+
+// returns true when signaled, false when the deadline passed first
+bool wakeup_wait_until(struct wakeup_t *wakeup, int64_t deadline_ns) {
+  struct pollfd pfd = {.fd = wakeup->read_fd, .events = POLLIN};
+
+  for (;;) {
+    int64_t timeout_ns = deadline_ns - get_monotonic_ns();
+    if (timeout_ns < 0)
+      timeout_ns = 0;
+
+#ifdef __linux__
+    struct timespec ts = {
+        .tv_sec = timeout_ns / SEC_TO_NS,
+        .tv_nsec = timeout_ns % SEC_TO_NS,
+    };
+    int ret = ppoll(&pfd, 1, &ts, NULL);
+#else
+    int ret = poll(&pfd, 1, (timeout_ns + MILLI_TO_NS - 1) / MILLI_TO_NS);
+#endif
+
+    if (ret > 0)
+      break;
+    if (ret == 0)
+      return false;
+    if (errno != EINTR)
+      return false;
+  }
+
+  uint64_t value;
+  while (read(wakeup->read_fd, &value, sizeof(value)) > 0)
+    ;
+
+  return true;
+}
+
+int64_t add_ns(int64_t a, int64_t b) {
+  int64_t result;
+  if (__builtin_add_overflow(a, b, &result))
+    return b > 0 ? INT64_MAX : INT64_MIN;
+
+  return result;
+}
+
+int64_t mul_ns(int64_t duration_ns, int64_t count) {
+  int64_t result;
+  if (__builtin_mul_overflow(duration_ns, count, &result))
+    return (duration_ns > 0) == (count > 0) ? INT64_MAX : INT64_MIN;
+
+  return result;
+}
+
+// mean and mean deviation updated like the TCP round-trip estimator, with
+// samples further than 4 deviations from the mean rejected
+bool latency_estimator_add(struct latency_estimator_t *estimator,
+                           int64_t sample_ns) {
+  if (estimator->samples == 0) {
+    estimator->mean_ns = sample_ns;
+    estimator->deviation_ns = sample_ns / 2;
+    estimator->samples = 1;
+    return true;
+  }
+
+  int64_t error_ns = sample_ns - estimator->mean_ns;
+  int64_t abs_error_ns = error_ns < 0 ? -error_ns : error_ns;
+
+  int64_t limit_ns = 4 * estimator->deviation_ns;
+  if (limit_ns < LATENCY_MIN_DEVIATION_NS)
+    limit_ns = LATENCY_MIN_DEVIATION_NS;
+
+  if (estimator->samples >= LATENCY_WARMUP && abs_error_ns > limit_ns &&
+      ++estimator->rejected < LATENCY_MAX_REJECTED)
+    return false;
+
+  estimator->rejected = 0;
+  estimator->mean_ns += error_ns / 8;
+  estimator->deviation_ns += (abs_error_ns - estimator->deviation_ns) / 4;
+  estimator->samples++;
+
+  return true;
+}
+
+int64_t latency_estimator_get(const struct latency_estimator_t *estimator) {
+  return estimator->mean_ns;
+}
+
+void jitter_stats_add(struct jitter_stats_t *stats, int64_t sample_ns) {
+  if (stats->count == 0 || sample_ns < stats->min_ns)
+    stats->min_ns = sample_ns;
+  if (stats->count == 0 || sample_ns > stats->max_ns)
+    stats->max_ns = sample_ns;
+
+  stats->count++;
+  double delta = (double)sample_ns - stats->mean_ns;
+  stats->mean_ns += delta / stats->count;
+  stats->m2 += delta * ((double)sample_ns - stats->mean_ns);
+}
+
+// newton's method, keeps the build free of libm
+int64_t jitter_stats_stddev_ns(const struct jitter_stats_t *stats) {
+  if (stats->count < 2)
+    return 0;
+
+  double variance = stats->m2 / stats->count;
+  if (variance <= 0)
+    return 0;
+
+  double root = variance;
+  for (int32_t i = 0; i < 64; i++) {
+    double next = (root + variance / root) / 2;
+    if (next >= root)
+      break;
+    root = next;
+  }
+
+  return (int64_t)root;
+}
 
 bool nssleep(int64_t timer_ns) {
   struct timespec ts = {
@@ -56,8 +294,52 @@ bool nssleep(int64_t timer_ns) {
   return true;
 }
 
-int64_t get_system_micros(void) {
+// sleeps until an absolute deadline on CLOCK_MONOTONIC, so the time spent
+// before calling it doesn't accumulate as drift
+bool sleep_until_ns(int64_t deadline_ns) {
+#ifdef __APPLE__
+  // no clock_nanosleep on macos
+  int64_t remaining_ns = deadline_ns - get_monotonic_ns();
+  return remaining_ns <= 0 || nssleep(remaining_ns);
+#else
+  struct timespec ts = {
+      .tv_sec = deadline_ns / SEC_TO_NS,
+      .tv_nsec = deadline_ns % SEC_TO_NS,
+  };
+
+  int ret;
+  while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) !=
+         0) {
+    if (ret != EINTR)
+      return false;
+  }
+
+  return true;
+#endif
+}
+
+int64_t precise_sleep_until_ns(int64_t deadline_ns, int64_t guard_ns,
+                               enum wait_mode mode) {
+  if (mode == WAIT_SLEEP || guard_ns <= 0) {
+    sleep_until_ns(deadline_ns);
+    return get_monotonic_ns();
+  }
+
+  int64_t coarse_ns = add_ns(deadline_ns, -guard_ns);
+  if (coarse_ns > get_monotonic_ns())
+    sleep_until_ns(coarse_ns);
+
+  int64_t now_ns;
+  while ((now_ns = get_monotonic_ns()) < deadline_ns) {
+    if (mode == WAIT_YIELD)
+      sched_yield();
+  }
+
+  return now_ns;
+}
+
+int64_t get_monotonic_ns(void) {
   struct timespec ts = {0, 0};
-  timespec_get(&ts, TIME_UTC);
-  return (int64_t)(ts.tv_sec * SEC_TO_US) + (int64_t)(ts.tv_nsec / MICRO_TO_NS);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * SEC_TO_NS + ts.tv_nsec;
 }
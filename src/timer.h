@@ -4,16 +4,103 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#define MICRO_TO_NS 1000ull
-#define MILLI_TO_NS 1000000ull
-#define SEC_TO_NS 1000000000ull
-#define SEC_TO_US 1000000ull
+// signed, durations and deadlines are int64_t nanoseconds everywhere
+#define MICRO_TO_NS INT64_C(1000)
+#define MILLI_TO_NS INT64_C(1000000)
+#define SEC_TO_NS INT64_C(1000000000)
 
-int32_t get_delay_average(void);
-void add_delay(int32_t delay);
+#define TIMERS_SIZE 16
+
+struct timer_entry_t {
+  int64_t deadline_ns;
+  int32_t cmd;
+  void *data;
+};
+
+// min-heap of commands scheduled on CLOCK_MONOTONIC deadlines
+struct timer_heap_t {
+  struct timer_entry_t entries[TIMERS_SIZE];
+  int32_t size;
+};
+
+#define TIMER_HEAP_INITIALIZER                                                 \
+  { .entries = {{0}}, .size = 0 }
+
+bool timer_heap_push(struct timer_heap_t *heap, int64_t deadline_ns,
+                     int32_t cmd, void *data);
+bool timer_heap_peek(const struct timer_heap_t *heap, int64_t *deadline_ns,
+                     int32_t *cmd);
+bool timer_heap_pop_expired(struct timer_heap_t *heap, int64_t now_ns,
+                            int32_t *cmd, void **data);
+
+// earliest deadline scheduled for cmd
+bool timer_heap_find(const struct timer_heap_t *heap, int32_t cmd,
+                     int64_t *deadline_ns);
+bool timer_heap_remove(struct timer_heap_t *heap, int32_t cmd);
+
+// cancellable wait backed by an eventfd (a pipe where not available);
+// wakeup_signal() is async-signal-safe
+struct wakeup_t {
+  int read_fd;
+  int write_fd;
+};
+
+#define WAKEUP_INITIALIZER                                                     \
+  { .read_fd = -1, .write_fd = -1 }
+
+bool wakeup_init(struct wakeup_t *wakeup);
+void wakeup_signal(struct wakeup_t *wakeup);
+bool wakeup_wait_until(struct wakeup_t *wakeup, int64_t deadline_ns);
+
+// saturate at INT64_MIN/INT64_MAX instead of wrapping
+int64_t add_ns(int64_t a, int64_t b);
+int64_t mul_ns(int64_t duration_ns, int64_t count);
+
+// robust running estimate of a latency, a single slow sample doesn't move it
+struct latency_estimator_t {
+  int64_t mean_ns;
+  int64_t deviation_ns;
+  int32_t samples;
+  int32_t rejected; // consecutive outliers
+};
+
+#define LATENCY_ESTIMATOR_INITIALIZER                                          \
+  { .mean_ns = 0, .deviation_ns = 0, .samples = 0, .rejected = 0 }
+
+// returns false when the sample was rejected as an outlier
+bool latency_estimator_add(struct latency_estimator_t *estimator,
+                           int64_t sample_ns);
+int64_t latency_estimator_get(const struct latency_estimator_t *estimator);
+
+// distribution of timing errors, variance by Welford's method
+struct jitter_stats_t {
+  int32_t count;
+  int64_t min_ns;
+  int64_t max_ns;
+  double mean_ns;
+  double m2;
+};
+
+#define JITTER_STATS_INITIALIZER                                               \
+  { .count = 0, .min_ns = 0, .max_ns = 0, .mean_ns = 0, .m2 = 0 }
+
+void jitter_stats_add(struct jitter_stats_t *stats, int64_t sample_ns);
+int64_t jitter_stats_stddev_ns(const struct jitter_stats_t *stats);
 
-bool ussleep(int32_t timer_us);
 bool nssleep(int64_t timer_ns);
-int64_t get_system_micros(void);
+bool sleep_until_ns(int64_t deadline_ns);
+
+enum wait_mode {
+  WAIT_SLEEP, // the scheduler alone, wakes up late by its jitter
+  WAIT_SPIN,  // busy-waits the guard band
+  WAIT_YIELD, // busy-waits the guard band yielding the cpu on each check
+};
+
+// sleeps until guard_ns before the deadline then polls the clock until it
+// passes; returns the time actually woken up at, the caller compares it
+// with the deadline
+int64_t precise_sleep_until_ns(int64_t deadline_ns, int64_t guard_ns,
+                               enum wait_mode mode);
+int64_t get_monotonic_ns(void);
 
 #endif // TIMER_H
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer.h"
+
+// wake-up lateness of precise_sleep_until_ns() in each wait mode, against
+// deadlines a few ms apart like the shutter steps of a fast sequence
+
+#define WAKEUPS 500
+#define PERIOD_NS (5 * MILLI_TO_NS)
+// the default --timer-guard
+#define GUARD_NS (2 * MILLI_TO_NS)
+
+static void bench_mode(const char *name, enum wait_mode mode,
+                       int64_t guard_ns) {
+  struct jitter_stats_t stats = JITTER_STATS_INITIALIZER;
+
+  int64_t deadline_ns = get_monotonic_ns();
+  for (int32_t i = 0; i < WAKEUPS; i++) {
+    deadline_ns += PERIOD_NS;
+    int64_t woke_ns = precise_sleep_until_ns(deadline_ns, guard_ns, mode);
+    jitter_stats_add(&stats, woke_ns - deadline_ns);
+  }
+
+  printf("%-5s guard %4lld us: lateness min %7.1f us, mean %7.1f us, "
+         "max %7.1f us, stddev %7.1f us\n",
+         name, (long long)(guard_ns / MICRO_TO_NS),
+         (double)stats.min_ns / MICRO_TO_NS, stats.mean_ns / MICRO_TO_NS,
+         (double)stats.max_ns / MICRO_TO_NS,
+         (double)jitter_stats_stddev_ns(&stats) / MICRO_TO_NS);
+}
+
+int main(int argc, char *argv[]) {
+  // an optional guard in us, to compare against a tuned --timer-guard
+  int64_t guard_ns = argc > 1 ? strtoll(argv[1], NULL, 10) * MICRO_TO_NS
+                              : GUARD_NS;
+
+  bench_mode("sleep", WAIT_SLEEP, 0);
+  bench_mode("spin", WAIT_SPIN, guard_ns);
+  bench_mode("yield", WAIT_YIELD, guard_ns);
+
+  return 0;
+}
@@ -0,0 +1,204 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "queue.h"
+#include "timer.h"
+
+// enqueue-to-dispatch latency and throughput of the lock-free command ring
+// against the mutex/condvar queue it replaced, kept here as the baseline
+
+#define THROUGHPUT_COMMANDS 1000000
+#define LATENCY_COMMANDS 2000
+// commands arrive while the consumer sleeps, like http requests do
+#define LATENCY_SPACING_NS (200 * MICRO_TO_NS)
+
+struct mutex_queue_t {
+  pthread_mutex_t mutex;
+  pthread_cond_t produced;
+  pthread_cond_t consumed;
+  int32_t buffer[BUFFER_SIZE];
+  void *buffer_data[BUFFER_SIZE];
+  int32_t nextin;
+  int32_t nextout;
+  int32_t size;
+};
+
+static void mutex_queue_init(struct mutex_queue_t *b) {
+  assert(pthread_mutex_init(&b->mutex, NULL) == 0);
+  assert(pthread_cond_init(&b->produced, NULL) == 0);
+  assert(pthread_cond_init(&b->consumed, NULL) == 0);
+  b->nextin = 0;
+  b->nextout = 0;
+  b->size = 0;
+}
+
+static void mutex_queue_enqueue(void *queue, int32_t cmd, void *data) {
+  struct mutex_queue_t *b = queue;
+  assert(pthread_mutex_lock(&b->mutex) == 0);
+
+  while (b->size >= BUFFER_SIZE)
+    assert(pthread_cond_wait(&b->consumed, &b->mutex) == 0);
+
+  int32_t nextin = b->nextin++;
+  b->nextin %= BUFFER_SIZE;
+  b->size++;
+
+  b->buffer[nextin] = cmd;
+  b->buffer_data[nextin] = data;
+
+  assert(pthread_cond_signal(&b->produced) == 0);
+  assert(pthread_mutex_unlock(&b->mutex) == 0);
+}
+
+static bool mutex_queue_dequeue(void *queue, int32_t *cmd, void **data,
+                                int64_t timer_ns) {
+  struct mutex_queue_t *b = queue;
+  assert(pthread_mutex_lock(&b->mutex) == 0);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timer_ns / SEC_TO_NS;
+  ts.tv_nsec += timer_ns % SEC_TO_NS;
+  ts.tv_sec += ts.tv_nsec / SEC_TO_NS;
+  ts.tv_nsec %= SEC_TO_NS;
+
+  while (b->size <= 0) {
+    if (pthread_cond_timedwait(&b->produced, &b->mutex, &ts) == ETIMEDOUT) {
+      assert(pthread_mutex_unlock(&b->mutex) == 0);
+      return false;
+    }
+  }
+
+  int32_t nextout = b->nextout++;
+  b->nextout %= BUFFER_SIZE;
+  b->size--;
+
+  *cmd = b->buffer[nextout];
+  *data = b->buffer_data[nextout];
+
+  assert(pthread_cond_signal(&b->consumed) == 0);
+  assert(pthread_mutex_unlock(&b->mutex) == 0);
+
+  return true;
+}
+
+static void ring_enqueue(void *queue, int32_t cmd, void *data) {
+  queue_enqueue(queue, cmd, data, NULL);
+}
+
+static bool ring_dequeue(void *queue, int32_t *cmd, void **data,
+                         int64_t timer_ns) {
+  struct completion_t *completion;
+  return queue_dequeue(queue, cmd, data, &completion, timer_ns) >= 0;
+}
+
+struct bench_queue_t {
+  const char *name;
+  void *queue;
+  void (*enqueue)(void *queue, int32_t cmd, void *data);
+  bool (*dequeue)(void *queue, int32_t *cmd, void **data, int64_t timer_ns);
+};
+
+struct producer_t {
+  const struct bench_queue_t *bench;
+  int32_t commands;
+  int64_t spacing_ns;
+};
+
+static void *produce(void *arg) {
+  struct producer_t *producer = arg;
+
+  for (int32_t i = 0; i < producer->commands; i++) {
+    if (producer->spacing_ns > 0)
+      nssleep(producer->spacing_ns);
+
+    // the send time travels in the command data
+    void *data = (void *)(intptr_t)get_monotonic_ns();
+    producer->bench->enqueue(producer->bench->queue, 0, data);
+  }
+
+  return NULL;
+}
+
+static void bench_throughput(const struct bench_queue_t *bench,
+                             int32_t producers) {
+  pthread_t threads[producers];
+  struct producer_t producer = {
+      .bench = bench,
+      .commands = THROUGHPUT_COMMANDS / producers,
+      .spacing_ns = 0,
+  };
+
+  int64_t start_ns = get_monotonic_ns();
+  for (int32_t i = 0; i < producers; i++)
+    assert(pthread_create(&threads[i], NULL, produce, &producer) == 0);
+
+  int32_t total = producer.commands * producers;
+  for (int32_t received = 0; received < total;) {
+    int32_t cmd;
+    void *data;
+    if (bench->dequeue(bench->queue, &cmd, &data, SEC_TO_NS))
+      received++;
+  }
+
+  int64_t elapsed_ns = get_monotonic_ns() - start_ns;
+  for (int32_t i = 0; i < producers; i++)
+    pthread_join(threads[i], NULL);
+
+  printf("%-6s throughput, %d producer%s: %8.0f commands/ms\n", bench->name,
+         producers, producers > 1 ? "s" : " ",
+         (double)total * MILLI_TO_NS / (double)elapsed_ns);
+}
+
+static void bench_latency(const struct bench_queue_t *bench) {
+  pthread_t thread;
+  struct producer_t producer = {
+      .bench = bench,
+      .commands = LATENCY_COMMANDS,
+      .spacing_ns = LATENCY_SPACING_NS,
+  };
+  assert(pthread_create(&thread, NULL, produce, &producer) == 0);
+
+  struct jitter_stats_t stats = JITTER_STATS_INITIALIZER;
+  for (int32_t received = 0; received < LATENCY_COMMANDS;) {
+    int32_t cmd;
+    void *data;
+    if (!bench->dequeue(bench->queue, &cmd, &data, SEC_TO_NS))
+      continue;
+
+    jitter_stats_add(&stats, get_monotonic_ns() - (int64_t)(intptr_t)data);
+    received++;
+  }
+
+  pthread_join(thread, NULL);
+
+  printf("%-6s enqueue to dispatch: mean %6.1f us, stddev %6.1f us, "
+         "max %7.1f us\n",
+         bench->name, stats.mean_ns / MICRO_TO_NS,
+         (double)jitter_stats_stddev_ns(&stats) / MICRO_TO_NS,
+         (double)stats.max_ns / MICRO_TO_NS);
+}
+
+int main(void) {
+  static struct mutex_queue_t mutex_queue;
+  mutex_queue_init(&mutex_queue);
+
+  static struct queue_t ring_queue = QUEUE_INITIALIZER;
+  assert(queue_init(&ring_queue, NULL));
+
+  struct bench_queue_t benches[] = {
+      {"mutex", &mutex_queue, mutex_queue_enqueue, mutex_queue_dequeue},
+      {"ring", &ring_queue, ring_enqueue, ring_dequeue},
+  };
+
+  for (int32_t i = 0; i < 2; i++) {
+    bench_throughput(&benches[i], 1);
+    bench_throughput(&benches[i], 4);
+    bench_latency(&benches[i]);
+  }
+
+  return 0;
+}
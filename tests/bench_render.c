@@ -0,0 +1,126 @@
+// render cpu per request with the fragment caches cold, as every request
+// was before them, and warm; the renderers are static, so http.c is built
+// into the benchmark with the camera side stubbed out
+
+#include "../src/http.c"
+
+#define RENDERS 2000
+#define EXPOSURES 69
+#define ISOS 39
+
+struct sync_queue_t g_main_queue = {
+    .queue = QUEUE_INITIALIZER,
+};
+
+static struct camera_state_t g_bench_state = {
+    .version = 1,
+    .capabilities_version = 1,
+    .running = true,
+    .iso_index = 3,
+    .exposure_index = 12,
+    .delay_ns = 2 * SEC_TO_NS,
+    .exposure_ns = 30 * SEC_TO_NS,
+    .interval_ns = 5 * SEC_TO_NS,
+    .frames = 100,
+    .initialized = true,
+    .connected = true,
+    .description = "Canon EOS",
+};
+
+void get_state_copy(struct camera_state_t *state) { *state = g_bench_state; }
+uint64_t get_state_version(void) { return g_bench_state.version; }
+bool is_running(void) { return true; }
+void set_state_listener(state_listener_fn listener) {}
+
+bool camera_post_command(int32_t cmd, completion_fn notify,
+                         void *notify_data) {
+  return false;
+}
+
+void get_event_pump_stats(struct event_pump_stats_t *stats) {
+  *stats = (struct event_pump_stats_t){0};
+}
+
+const char *set_iso_index(const char *index_str, const char **notice) {
+  *notice = NULL;
+  return NULL;
+}
+
+const char *set_exposure_index(const char *index_str, const char **notice) {
+  *notice = NULL;
+  return NULL;
+}
+
+const char *set_exposure_custom(const char *value_str) { return NULL; }
+const char *set_delay(const char *value_str) { return NULL; }
+const char *set_interval(const char *value_str) { return NULL; }
+const char *set_frames(const char *value_str) { return NULL; }
+
+const char *apply_settings(const struct camera_settings_t *settings) {
+  return NULL;
+}
+
+const char *apply_property_settings(const struct camera_settings_t *settings,
+                                    completion_fn notify, void *notify_data,
+                                    bool *posted) {
+  *posted = false;
+  return NULL;
+}
+
+void get_exposure_at(int32_t index, char *value_str, size_t size) {
+  mg_snprintf(value_str, size, "1/%d", 8000 >> (index % 13));
+}
+
+int32_t get_exposure_count(void) { return EXPOSURES; }
+
+void get_iso_at(int32_t index, char *value_str, size_t size) {
+  mg_snprintf(value_str, size, "%d", 100 << (index % 8));
+}
+
+int32_t get_iso_count(void) { return ISOS; }
+
+static void invalidate_caches(void) {
+  g_exposure_cache.valid = false;
+  g_iso_cache.valid = false;
+  g_content_cache.valid = false;
+}
+
+// like mg_http_reply(), into a connection's send buffer
+static void bench_render(const char *name, mg_pm_t render, bool cold) {
+  struct mg_iobuf out = {.align = 1024};
+  struct camera_state_t state;
+  get_state_copy(&state);
+
+  int64_t start_ns = get_monotonic_ns();
+  for (int32_t i = 0; i < RENDERS; i++) {
+    if (cold)
+      invalidate_caches();
+
+    out.len = 0;
+    mg_xprintf(mg_pfn_iobuf, &out, "%M", render, &state);
+  }
+  int64_t elapsed_ns = get_monotonic_ns() - start_ns;
+
+  printf("%-8s %-4s %6zu bytes: %8.2f us/render\n", name,
+         cold ? "cold" : "warm", out.len,
+         (double)elapsed_ns / RENDERS / MICRO_TO_NS);
+
+  mg_iobuf_free(&out);
+}
+
+int main(void) {
+  mg_log_set(MG_LL_ERROR);
+
+  bench_render("content", render_content, true);
+  bench_render("content", render_content, false);
+  bench_render("exposure", render_exposure, true);
+  bench_render("exposure", render_exposure, false);
+  bench_render("iso", render_iso, true);
+  bench_render("iso", render_iso, false);
+
+  fragment_cache_free(&g_exposure_cache);
+  fragment_cache_free(&g_iso_cache);
+  fragment_cache_free(&g_content_cache);
+
+  return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// a failed check is reported and the test carries on, main() returns
+// test_result()
+static int32_t g_test_failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,        \
+              #cond);                                                          \
+      g_test_failures++;                                                       \
+    }                                                                          \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                         \
+  do {                                                                         \
+    long long a_ = (long long)(a), b_ = (long long)(b);                        \
+    if (a_ != b_) {                                                            \
+      fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n",        \
+              __FILE__, __LINE__, #a, #b, a_, b_);                             \
+      g_test_failures++;                                                       \
+    }                                                                          \
+  } while (0)
+
+#define RUN_TEST(test)                                                         \
+  do {                                                                         \
+    int32_t failures = g_test_failures;                                        \
+    test();                                                                    \
+    printf("%-40s %s\n", #test,                                                \
+           g_test_failures == failures ? "ok" : "FAILED");                     \
+  } while (0)
+
+static inline int test_result(void) {
+  return g_test_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // TEST_H
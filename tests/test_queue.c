@@ -0,0 +1,261 @@
+#include <pthread.h>
+
+#include "queue.h"
+#include "test.h"
+#include "timer.h"
+
+#define HOUR_NS (3600 * SEC_TO_NS)
+#define DAY_NS (24 * HOUR_NS)
+
+// a stop is dispatched within this, whatever the command thread waits for
+#define STOP_LATENCY_NS (50 * MILLI_TO_NS)
+
+enum test_command {
+  CMD_DATA,
+  CMD_OTHER_DATA,
+  CMD_STOP,
+};
+
+static enum queue_lane test_lane(int32_t cmd) {
+  return cmd == CMD_STOP ? QUEUE_LANE_CONTROL : QUEUE_LANE_DATA;
+}
+
+static void test_control_lane_first(void) {
+  struct queue_t queue = QUEUE_INITIALIZER;
+  CHECK(queue_init(&queue, test_lane));
+
+  CHECK(queue_enqueue(&queue, CMD_DATA, (void *)1, NULL) >= 0);
+  CHECK(queue_enqueue(&queue, CMD_OTHER_DATA, (void *)2, NULL) >= 0);
+  CHECK(queue_enqueue(&queue, CMD_STOP, (void *)3, NULL) >= 0);
+
+  int32_t expected_cmds[] = {CMD_STOP, CMD_DATA, CMD_OTHER_DATA};
+  uintptr_t expected_data[] = {3, 1, 2};
+
+  for (int32_t i = 0; i < 3; i++) {
+    int32_t cmd;
+    void *data;
+    struct completion_t *completion;
+    CHECK(queue_dequeue(&queue, &cmd, &data, &completion, 0) >= 0);
+    CHECK_EQ(cmd, expected_cmds[i]);
+    CHECK_EQ((uintptr_t)data, expected_data[i]);
+  }
+
+  int32_t cmd;
+  void *data;
+  struct completion_t *completion;
+  CHECK(queue_dequeue(&queue, &cmd, &data, &completion, 0) < 0);
+}
+
+static void test_full_lane(void) {
+  struct queue_t queue = QUEUE_INITIALIZER;
+  CHECK(queue_init(&queue, test_lane));
+
+  for (int32_t i = 0; i < BUFFER_SIZE; i++)
+    CHECK(queue_try_enqueue(&queue, CMD_DATA, NULL, NULL) >= 0);
+
+  // a full data lane neither blocks nor holds up the control lane
+  CHECK(queue_try_enqueue(&queue, CMD_DATA, NULL, NULL) < 0);
+  CHECK(queue_try_enqueue(&queue, CMD_STOP, NULL, NULL) >= 0);
+
+  struct queue_lane_stats_t stats;
+  queue_get_stats(&queue, QUEUE_LANE_DATA, &stats);
+  CHECK_EQ(stats.depth, BUFFER_SIZE);
+
+  int32_t cmd;
+  void *data;
+  struct completion_t *completion;
+  CHECK(queue_dequeue(&queue, &cmd, &data, &completion, 0) >= 0);
+  CHECK(queue_dequeue(&queue, &cmd, &data, &completion, 0) >= 0);
+  CHECK(queue_try_enqueue(&queue, CMD_DATA, NULL, NULL) >= 0);
+}
+
+#define PRODUCERS 4
+#define PRODUCED 20000
+
+struct producer_t {
+  struct queue_t *queue;
+  uintptr_t id;
+};
+
+static void *produce(void *arg) {
+  struct producer_t *producer = arg;
+
+  for (uintptr_t i = 0; i < PRODUCED; i++) {
+    uintptr_t value = producer->id << 24 | i;
+    queue_enqueue(producer->queue, CMD_DATA, (void *)value, NULL);
+  }
+
+  return NULL;
+}
+
+// every command arrives once, and in order for each producer
+static void test_producers(void) {
+  struct queue_t queue = QUEUE_INITIALIZER;
+  CHECK(queue_init(&queue, test_lane));
+
+  pthread_t threads[PRODUCERS];
+  struct producer_t producers[PRODUCERS];
+  for (uintptr_t i = 0; i < PRODUCERS; i++) {
+    producers[i] = (struct producer_t){.queue = &queue, .id = i};
+    CHECK(pthread_create(&threads[i], NULL, produce, &producers[i]) == 0);
+  }
+
+  uintptr_t next[PRODUCERS] = {0};
+  int32_t received = 0;
+  int32_t out_of_order = 0;
+
+  while (received < PRODUCERS * PRODUCED) {
+    int32_t cmd;
+    void *data;
+    struct completion_t *completion;
+    if (queue_dequeue(&queue, &cmd, &data, &completion, SEC_TO_NS) < 0)
+      break;
+
+    uintptr_t value = (uintptr_t)data;
+    uintptr_t id = value >> 24;
+    if (id >= PRODUCERS || (value & 0xffffff) != next[id]++)
+      out_of_order++;
+
+    received++;
+  }
+
+  for (int32_t i = 0; i < PRODUCERS; i++)
+    pthread_join(threads[i], NULL);
+
+  CHECK_EQ(received, PRODUCERS * PRODUCED);
+  CHECK_EQ(out_of_order, 0);
+}
+
+struct stop_waiter_t {
+  struct queue_t *queue;
+  int32_t cmd;
+  int64_t woke_ns;
+};
+
+// the command thread idling until a frame a day away
+static void *wait_for_command(void *arg) {
+  struct stop_waiter_t *waiter = arg;
+
+  void *data;
+  struct completion_t *completion;
+  waiter->cmd = -1;
+  queue_dequeue(waiter->queue, &waiter->cmd, &data, &completion, DAY_NS);
+  waiter->woke_ns = get_monotonic_ns();
+
+  return NULL;
+}
+
+static void test_stop_latency(void) {
+  struct queue_t queue = QUEUE_INITIALIZER;
+  CHECK(queue_init(&queue, test_lane));
+
+  int64_t max_latency_ns = 0;
+
+  for (int32_t i = 0; i < 20; i++) {
+    struct stop_waiter_t waiter = {.queue = &queue};
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, wait_for_command, &waiter) == 0);
+
+    // let it get past its spins and into the sleep
+    nssleep(5 * MILLI_TO_NS);
+
+    int64_t stop_ns = get_monotonic_ns();
+    CHECK(queue_try_enqueue(&queue, CMD_STOP, NULL, NULL) >= 0);
+    pthread_join(thread, NULL);
+
+    CHECK_EQ(waiter.cmd, CMD_STOP);
+    if (waiter.woke_ns - stop_ns > max_latency_ns)
+      max_latency_ns = waiter.woke_ns - stop_ns;
+  }
+
+  printf("  stop latency: max %lld us\n",
+         (long long)(max_latency_ns / MICRO_TO_NS));
+  CHECK(max_latency_ns < STOP_LATENCY_NS);
+}
+
+static void test_interrupt(void) {
+  struct sync_queue_t queue = {.queue = QUEUE_INITIALIZER};
+  CHECK(async_queue_init(&queue, test_lane));
+
+  async_queue_interrupt(&queue);
+
+  int64_t start_ns = get_monotonic_ns();
+  int32_t cmd;
+  void *data;
+  struct completion_t *completion;
+  CHECK(async_queue_dequeue_locked(&queue, &cmd, &data, &completion, DAY_NS) <
+        0);
+  CHECK(get_monotonic_ns() - start_ns < STOP_LATENCY_NS);
+}
+
+static void *complete_one(void *arg) {
+  struct sync_queue_t *queue = arg;
+
+  int32_t cmd;
+  void *data;
+  struct completion_t *completion;
+  if (async_queue_dequeue_locked(queue, &cmd, &data, &completion, SEC_TO_NS) >=
+      0)
+    async_queue_complete(completion, cmd * 10);
+
+  return NULL;
+}
+
+static void test_submit(void) {
+  struct sync_queue_t queue = {.queue = QUEUE_INITIALIZER};
+  CHECK(async_queue_init(&queue, test_lane));
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, complete_one, &queue) == 0);
+
+  struct completion_t *completion =
+      async_queue_submit(&queue, CMD_OTHER_DATA, NULL);
+
+  int32_t result = 0;
+  CHECK(completion_wait(completion, WAIT_FOREVER, &result));
+  CHECK_EQ(result, CMD_OTHER_DATA * 10);
+  completion_release(completion);
+
+  pthread_join(thread, NULL);
+}
+
+static _Atomic int32_t g_notified = 0;
+
+static void count_notify(int32_t result, void *data) {
+  atomic_fetch_add(&g_notified, result);
+}
+
+static void test_post_notify(void) {
+  struct sync_queue_t queue = {.queue = QUEUE_INITIALIZER};
+  CHECK(async_queue_init(&queue, test_lane));
+
+  for (int32_t i = 0; i < BUFFER_SIZE; i++)
+    CHECK(async_queue_post_notify(&queue, CMD_DATA, NULL, count_notify, NULL));
+
+  // full, refused right away
+  CHECK(!async_queue_post_notify(&queue, CMD_DATA, NULL, count_notify, NULL));
+  CHECK(!async_queue_try_post(&queue, CMD_DATA, NULL));
+
+  for (int32_t i = 0; i < BUFFER_SIZE; i++) {
+    int32_t cmd;
+    void *data;
+    struct completion_t *completion;
+    CHECK(async_queue_dequeue_locked(&queue, &cmd, &data, &completion, 0) >=
+          0);
+    async_queue_complete(completion, 1);
+  }
+
+  CHECK_EQ(atomic_load(&g_notified), BUFFER_SIZE);
+}
+
+int main(void) {
+  RUN_TEST(test_control_lane_first);
+  RUN_TEST(test_full_lane);
+  RUN_TEST(test_producers);
+  RUN_TEST(test_stop_latency);
+  RUN_TEST(test_interrupt);
+  RUN_TEST(test_submit);
+  RUN_TEST(test_post_notify);
+
+  return test_result();
+}
@@ -0,0 +1,140 @@
+#include <string.h>
+
+#include "settings.h"
+#include "test.h"
+#include "timer.h"
+
+#define HOUR_NS (3600 * SEC_TO_NS)
+#define DAY_NS (24 * HOUR_NS)
+
+// a camera with 50 exposures, index 50 is bulb
+static const struct settings_limits_t limits = {
+    .iso_count = 10,
+    .exposure_count = 50,
+    .trigger_latency_ns = 40 * MILLI_TO_NS,
+};
+
+static void test_parse_seconds(void) {
+  int64_t value_ns = 0;
+
+  CHECK(parse_seconds("86400", &value_ns));
+  CHECK_EQ(value_ns, DAY_NS);
+  CHECK(parse_seconds("7200", &value_ns));
+  CHECK_EQ(value_ns, 2 * HOUR_NS);
+  // a year of seconds is still exact to the millisecond
+  CHECK(parse_seconds("31536000.001", &value_ns));
+  CHECK_EQ(value_ns, 365 * DAY_NS + MILLI_TO_NS);
+  CHECK(parse_seconds("1.5", &value_ns));
+  CHECK_EQ(value_ns, 1500 * MILLI_TO_NS);
+
+  CHECK(!parse_seconds("-1", &value_ns));
+  CHECK(!parse_seconds("1e30", &value_ns));
+  CHECK(!parse_seconds("day", &value_ns));
+}
+
+static void test_validate_long_settings(void) {
+  struct camera_settings_t settings = {
+      .fields = SETTING_INTERVAL | SETTING_EXPOSURE | SETTING_EXPOSURE_INDEX |
+                SETTING_DELAY,
+      .interval_ns = DAY_NS,
+      .exposure_ns = 2 * HOUR_NS,
+      .exposure_index = 50,
+      .delay_ns = DAY_NS,
+  };
+  CHECK(validate_settings(&settings, &limits) == NULL);
+
+  settings.exposure_index = 51;
+  CHECK(validate_settings(&settings, &limits) != NULL);
+  settings.exposure_index = 50;
+
+  settings.interval_ns = 10 * MILLI_TO_NS;
+  CHECK(validate_settings(&settings, &limits) != NULL);
+  settings.interval_ns = DAY_NS;
+
+  settings.exposure_ns = 0;
+  CHECK(validate_settings(&settings, &limits) != NULL);
+}
+
+static void test_json_wide_fields(void) {
+  struct camera_settings_t settings;
+  char error_str[64];
+
+  const char *json = "{\"interval_ns\":86400000000000,"
+                     "\"exposure_ns\":7200000000000,\"frames\":365}";
+  CHECK(parse_settings_json(mg_str(json), &settings, error_str,
+                            sizeof(error_str)) == NULL);
+  CHECK_EQ(settings.fields, SETTING_INTERVAL | SETTING_EXPOSURE |
+                                SETTING_FRAMES);
+  CHECK_EQ(settings.interval_ns, DAY_NS);
+  CHECK_EQ(settings.exposure_ns, 2 * HOUR_NS);
+  CHECK_EQ(settings.frames, 365);
+  CHECK(validate_settings(&settings, &limits) == NULL);
+
+  // a day in ns doesn't fit the 32-bit fields
+  const char *error = parse_settings_json(
+      mg_str("{\"frames\":86400000000000}"), &settings, error_str,
+      sizeof(error_str));
+  CHECK(error != NULL);
+  CHECK(strcmp(error, "frames must be an integer in range") == 0);
+
+  // past 2^53 ns a double no longer holds every integer
+  CHECK(parse_settings_json(mg_str("{\"delay_ns\":9007199254740993000}"),
+                            &settings, error_str, sizeof(error_str)) != NULL);
+  CHECK(parse_settings_json(mg_str("{\"delay_ns\":1.5}"), &settings, error_str,
+                            sizeof(error_str)) != NULL);
+  CHECK(parse_settings_json(mg_str("{\"days\":1}"), &settings, error_str,
+                            sizeof(error_str)) != NULL);
+  CHECK(parse_settings_json(mg_str("[1]"), &settings, error_str,
+                            sizeof(error_str)) != NULL);
+}
+
+// daily frames for a year, frame N at start + N * interval
+static void test_day_intervals(void) {
+  int64_t interval_ns = 0;
+  CHECK(parse_seconds("86400", &interval_ns));
+
+  int64_t start_ns = get_monotonic_ns();
+  struct frame_plan_t plan;
+  frame_plan_init(&plan, start_ns, 366, interval_ns, 30 * SEC_TO_NS, false);
+
+  CHECK_EQ(plan.period_ns, DAY_NS);
+  CHECK_EQ(frame_plan_deadline_ns(&plan, 0), start_ns);
+  CHECK_EQ(frame_plan_deadline_ns(&plan, 365), start_ns + 365 * DAY_NS);
+
+  // far beyond any plan the deadline saturates instead of wrapping into the
+  // past, where it would fire right away
+  int64_t far_ns = frame_plan_deadline_ns(&plan, INT32_MAX);
+  CHECK_EQ(far_ns, INT64_MAX);
+}
+
+// two hour bulb exposures once a day, past the old int32_t microsecond limit
+// of about 35 minutes
+static void test_bulb_hours(void) {
+  int64_t interval_ns = 0, exposure_ns = 0;
+  CHECK(parse_seconds("86400", &interval_ns));
+  CHECK(parse_seconds("7200", &exposure_ns));
+
+  int64_t start_ns = get_monotonic_ns();
+  struct frame_plan_t plan;
+  frame_plan_init(&plan, start_ns, 30, interval_ns, exposure_ns, true);
+
+  // the interval is the gap between exposures
+  CHECK_EQ(plan.period_ns, DAY_NS + 2 * HOUR_NS);
+  int64_t frame_ns = frame_plan_deadline_ns(&plan, 29);
+  CHECK_EQ(frame_ns, start_ns + 29 * (DAY_NS + 2 * HOUR_NS));
+
+  int64_t latency_ns = 80 * MILLI_TO_NS;
+  int64_t release_ns = frame_plan_release_ns(&plan, frame_ns, latency_ns);
+  CHECK_EQ(release_ns - frame_ns, 2 * HOUR_NS - latency_ns);
+  CHECK(release_ns < frame_plan_deadline_ns(&plan, 30));
+}
+
+int main(void) {
+  RUN_TEST(test_parse_seconds);
+  RUN_TEST(test_validate_long_settings);
+  RUN_TEST(test_json_wide_fields);
+  RUN_TEST(test_day_intervals);
+  RUN_TEST(test_bulb_hours);
+
+  return test_result();
+}
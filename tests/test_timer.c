@@ -0,0 +1,191 @@
+#include <pthread.h>
+
+#include "test.h"
+#include "timer.h"
+
+#define HOUR_NS (3600 * SEC_TO_NS)
+#define DAY_NS (24 * HOUR_NS)
+
+static void test_add_ns(void) {
+  CHECK_EQ(add_ns(1, 2), 3);
+  CHECK_EQ(add_ns(-5, 2), -3);
+  CHECK_EQ(add_ns(INT64_MAX, 1), INT64_MAX);
+  CHECK_EQ(add_ns(INT64_MAX - 1, INT64_MAX), INT64_MAX);
+  CHECK_EQ(add_ns(INT64_MIN, -1), INT64_MIN);
+  CHECK_EQ(add_ns(INT64_MIN, INT64_MAX), -1);
+}
+
+static void test_mul_ns(void) {
+  CHECK_EQ(mul_ns(3, 4), 12);
+  CHECK_EQ(mul_ns(-3, 4), -12);
+  CHECK_EQ(mul_ns(DAY_NS, 0), 0);
+  CHECK_EQ(mul_ns(INT64_MAX / 2 + 1, 2), INT64_MAX);
+  CHECK_EQ(mul_ns(INT64_MAX, -2), INT64_MIN);
+  CHECK_EQ(mul_ns(-INT64_MAX, -2), INT64_MAX);
+}
+
+static void test_timer_heap_order(void) {
+  struct timer_heap_t heap = TIMER_HEAP_INITIALIZER;
+  int64_t deadlines[] = {50, DAY_NS, 10, 2 * HOUR_NS, 30, 20, 40};
+  int32_t count = sizeof(deadlines) / sizeof(deadlines[0]);
+
+  for (int32_t i = 0; i < count; i++)
+    CHECK(timer_heap_push(&heap, deadlines[i], i, NULL));
+
+  int64_t deadline_ns;
+  int32_t cmd;
+  CHECK(timer_heap_peek(&heap, &deadline_ns, &cmd));
+  CHECK_EQ(deadline_ns, 10);
+  CHECK_EQ(cmd, 2);
+
+  // nothing is due before the earliest deadline
+  void *data;
+  CHECK(!timer_heap_pop_expired(&heap, 9, &cmd, &data));
+
+  int64_t expected[] = {10, 20, 30, 40, 50, 2 * HOUR_NS, DAY_NS};
+  for (int32_t i = 0; i < count; i++) {
+    CHECK(timer_heap_peek(&heap, &deadline_ns, &cmd));
+    CHECK_EQ(deadline_ns, expected[i]);
+    CHECK(timer_heap_pop_expired(&heap, INT64_MAX, &cmd, &data));
+  }
+
+  CHECK(!timer_heap_peek(&heap, &deadline_ns, &cmd));
+}
+
+static void test_timer_heap_find_remove(void) {
+  struct timer_heap_t heap = TIMER_HEAP_INITIALIZER;
+  CHECK(timer_heap_push(&heap, 300, 1, NULL));
+  CHECK(timer_heap_push(&heap, 100, 2, NULL));
+  CHECK(timer_heap_push(&heap, 200, 1, NULL));
+  CHECK(timer_heap_push(&heap, 400, 3, NULL));
+
+  int64_t deadline_ns;
+  CHECK(timer_heap_find(&heap, 1, &deadline_ns));
+  CHECK_EQ(deadline_ns, 200);
+  CHECK(!timer_heap_find(&heap, 4, &deadline_ns));
+
+  CHECK(timer_heap_remove(&heap, 2));
+  CHECK(!timer_heap_find(&heap, 2, &deadline_ns));
+
+  int32_t cmd;
+  CHECK(timer_heap_peek(&heap, &deadline_ns, &cmd));
+  CHECK_EQ(deadline_ns, 200);
+  CHECK_EQ(cmd, 1);
+}
+
+static void test_timer_heap_full(void) {
+  struct timer_heap_t heap = TIMER_HEAP_INITIALIZER;
+
+  for (int32_t i = 0; i < TIMERS_SIZE; i++)
+    CHECK(timer_heap_push(&heap, TIMERS_SIZE - i, i, NULL));
+
+  CHECK(!timer_heap_push(&heap, 0, TIMERS_SIZE, NULL));
+  CHECK_EQ(heap.size, TIMERS_SIZE);
+}
+
+static void test_latency_estimator(void) {
+  struct latency_estimator_t estimator = LATENCY_ESTIMATOR_INITIALIZER;
+  CHECK_EQ(latency_estimator_get(&estimator), 0);
+
+  for (int32_t i = 0; i < 32; i++)
+    CHECK(latency_estimator_add(&estimator, 40 * MILLI_TO_NS));
+  CHECK_EQ(latency_estimator_get(&estimator), 40 * MILLI_TO_NS);
+
+  // one slow sample is rejected and doesn't move the estimate
+  CHECK(!latency_estimator_add(&estimator, 900 * MILLI_TO_NS));
+  CHECK_EQ(latency_estimator_get(&estimator), 40 * MILLI_TO_NS);
+
+  // a lasting change is adopted after a few rejections
+  bool adopted = false;
+  for (int32_t i = 0; i < 16 && !adopted; i++)
+    adopted = latency_estimator_add(&estimator, 900 * MILLI_TO_NS);
+  CHECK(adopted);
+  CHECK(latency_estimator_get(&estimator) > 40 * MILLI_TO_NS);
+
+  for (int32_t i = 0; i < 64; i++)
+    latency_estimator_add(&estimator, 900 * MILLI_TO_NS);
+  int64_t error_ns = latency_estimator_get(&estimator) - 900 * MILLI_TO_NS;
+  CHECK(error_ns > -MILLI_TO_NS && error_ns < MILLI_TO_NS);
+}
+
+static void test_jitter_stats(void) {
+  struct jitter_stats_t stats = JITTER_STATS_INITIALIZER;
+  CHECK_EQ(jitter_stats_stddev_ns(&stats), 0);
+
+  int64_t samples[] = {2, 4, 4, 4, 5, 5, 7, 9};
+  for (int32_t i = 0; i < 8; i++)
+    jitter_stats_add(&stats, samples[i] * MICRO_TO_NS);
+
+  CHECK_EQ(stats.count, 8);
+  CHECK_EQ(stats.min_ns, 2 * MICRO_TO_NS);
+  CHECK_EQ(stats.max_ns, 9 * MICRO_TO_NS);
+  CHECK_EQ((int64_t)stats.mean_ns, 5 * MICRO_TO_NS);
+  // population standard deviation of the samples is exactly 2
+  int64_t stddev_ns = jitter_stats_stddev_ns(&stats);
+  CHECK(stddev_ns >= 2 * MICRO_TO_NS - 1 && stddev_ns <= 2 * MICRO_TO_NS + 1);
+}
+
+static void test_wakeup_timeout(void) {
+  struct wakeup_t wakeup = WAKEUP_INITIALIZER;
+  CHECK(wakeup_init(&wakeup));
+
+  int64_t deadline_ns = get_monotonic_ns() + 20 * MILLI_TO_NS;
+  CHECK(!wakeup_wait_until(&wakeup, deadline_ns));
+  CHECK(get_monotonic_ns() >= deadline_ns);
+
+  // a signal is kept until the next wait
+  wakeup_signal(&wakeup);
+  int64_t start_ns = get_monotonic_ns();
+  CHECK(wakeup_wait_until(&wakeup, start_ns + DAY_NS));
+  CHECK(get_monotonic_ns() - start_ns < 50 * MILLI_TO_NS);
+}
+
+static void *signal_later(void *wakeup) {
+  nssleep(10 * MILLI_TO_NS);
+  wakeup_signal(wakeup);
+  return NULL;
+}
+
+// a day long wait ends as soon as it is signaled
+static void test_wakeup_cancels_long_wait(void) {
+  struct wakeup_t wakeup = WAKEUP_INITIALIZER;
+  CHECK(wakeup_init(&wakeup));
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, signal_later, &wakeup) == 0);
+
+  int64_t start_ns = get_monotonic_ns();
+  CHECK(wakeup_wait_until(&wakeup, start_ns + DAY_NS));
+  CHECK(get_monotonic_ns() - start_ns < 50 * MILLI_TO_NS);
+
+  pthread_join(thread, NULL);
+}
+
+static void test_precise_sleep(void) {
+  enum wait_mode modes[] = {WAIT_SLEEP, WAIT_SPIN, WAIT_YIELD};
+
+  for (int32_t i = 0; i < 3; i++) {
+    int64_t deadline_ns = get_monotonic_ns() + 5 * MILLI_TO_NS;
+    int64_t woke_ns =
+        precise_sleep_until_ns(deadline_ns, 2 * MILLI_TO_NS, modes[i]);
+
+    // never early, and not absurdly late even on a loaded machine
+    CHECK(woke_ns >= deadline_ns);
+    CHECK(woke_ns - deadline_ns < 50 * MILLI_TO_NS);
+  }
+}
+
+int main(void) {
+  RUN_TEST(test_add_ns);
+  RUN_TEST(test_mul_ns);
+  RUN_TEST(test_timer_heap_order);
+  RUN_TEST(test_timer_heap_find_remove);
+  RUN_TEST(test_timer_heap_full);
+  RUN_TEST(test_latency_estimator);
+  RUN_TEST(test_jitter_stats);
+  RUN_TEST(test_wakeup_timeout);
+  RUN_TEST(test_wakeup_cancels_long_wait);
+  RUN_TEST(test_precise_sleep);
+
+  return test_result();
+}
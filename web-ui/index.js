@@ -9,3 +9,27 @@ htmx.on("htmx:afterSwap", function(evt) {
 htmx.on("htmx:responseError", function(evt) {
   console.log(evt);
 });
+
+// state changes are pushed by the server, only the fields that changed are
+// sent; a change of mode or of a setting made on the camera itself
+// re-renders the whole content, changes made on this page are already shown
+const events = new EventSource("/api/camera/events");
+
+events.onmessage = function(evt) {
+  const delta = JSON.parse(evt.data);
+
+  if ("frames_taken" in delta)
+    document.querySelectorAll(".frames-taken").forEach(function(el) {
+      el.textContent = delta.frames_taken;
+    });
+
+  if ("frames" in delta)
+    document.querySelectorAll(".frames-total").forEach(function(el) {
+      el.textContent = delta.frames;
+    });
+
+  if ("initialized" in delta || "connected" in delta || "shooting" in delta ||
+      "camera_changes" in delta)
+    htmx.ajax("GET", "/api/camera/state",
+              {target : ".content", swap : "outerHTML"});
+};